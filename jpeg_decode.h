@@ -22,12 +22,195 @@ extern "C" {
 #define ERR_NO_EOI 13
 #define ERR_BAD_TABLES 14
 #define ERR_DEPTH_MISMATCH 15
+#define ERR_EOF 16
 
+// returns number of bytes read into `data`, 0 at end of input, <0 on error
 typedef int (*jpeg_read_t)(void* that, void* data, int bytes);
 
+#ifndef jpeg_dct_defined
+#define jpeg_dct_defined
+// DCT methods shared by encoder and decoder:
+//   fast      AAN with 8 (encoder) or 11 (decoder) bit integer constants
+//   accurate  LLM with 13 bit integer constants (libjpeg "islow"), SSE2
+//             or AVX2 picked at run time in the decoder
+//   float     AAN in single precision floating point
+// default is float for the encoder and accurate for the decoder
+enum { jpeg_dct_default, jpeg_dct_fast, jpeg_dct_accurate, jpeg_dct_float };
+#endif
+
+// output pixel formats, *comp is set to bytes per pixel:
+//   yuyv    Y0 Cb Y1 Cr per pixel pair (2)
+//   rgb24   R G B (3)
+//   rgba32  R G B A with A = 255 (4)
+//   bgra32  B G R A with A = 255 (4)
+//   rgb565  little endian 16 bit R5 G6 B5 (2)
+// planar formats, Y plane of width bytes per row followed by (1):
+//   i420    Cb then Cr plane of (width + 1) / 2 x (height + 1) / 2
+//   nv12    interleaved Cb Cr plane of (width + 1) / 2 pairs per row
+//   yuv444p Cb then Cr plane of width x height
+//   gray    Y plane only, chroma is entropy decoded but never reconstructed
+// Chroma blocks are stored as is when the image is subsampled the same way,
+// otherwise upsampled by replication or downsampled by averaging.
+// Grayscale images have Cb = Cr = 128.
+enum {
+    jpeg_format_yuyv, jpeg_format_rgb24, jpeg_format_rgba32,
+    jpeg_format_bgra32, jpeg_format_rgb565, jpeg_format_i420,
+    jpeg_format_nv12, jpeg_format_yuv444p, jpeg_format_gray
+};
+
+// Scale 2, 4 or 8 runs reduced 4x4, 2x2 or 1x1 IDCTs per block (libjpeg
+// scale_denom) for a picture of *width = ceil(width / scale) by *height =
+// ceil(height / scale). `dct` only applies to full size decodes.
+// A crop window makes *width x *height the window (clipped to the picture)
+// and the output holds just its pixels. MCUs outside are entropy decoded
+// only, rows below it not at all. yuyv rounds x, i420 and nv12 x and y down
+// to even, growing the window by the pixel.
+// threads > 1 decodes in memory images with a restart interval (DRI) on
+// that many threads, each taking a run of the intervals found by scanning
+// for RSTn markers. Without DRI the scan is cut into chunks of at least
+// 64KB decoded speculatively and stitched together where Huffman decoding
+// resynchronizes, entropy decoding twice over in exchange for running on
+// every thread; the output is that of the sequential decoder either way.
+// Streamed input, threads 0 or 1 and builds with jpeg_decode_no_threads
+// decode on the calling thread. The calling thread takes a share, the
+// threads - 1 others are started by the first decode that needs them and
+// kept by the context (jpeg_decode_ex() creates one per call, so there
+// they are started and joined every call). Link with -pthread where POSIX
+// threads need it.
+typedef struct jpeg_decode_options_s {
+    int dct;    // jpeg_dct_* inverse DCT method (0: accurate)
+    int format; // jpeg_format_* output pixels (0: yuyv)
+    int scale;  // 1, 2, 4 or 8: output is 1 / scale of the image (0: 1)
+    int x, y;   // crop window origin in (scaled) picture pixels
+    int w, h;   // crop window size (0: to the right or bottom edge)
+    int threads; // restart intervals decoded on up to this many threads
+} jpeg_decode_options_t;
+
+// Decodes baseline JPEG pulled through `read` in 4KB chunks or, when `read`
+// is NULL, from memory at `data`. `output` points to a `void*` picture in
+// options->format reallocated to *width x *height (*comp set to bytes per
+// pixel, of the Y plane for planar formats).
+// Returns 0, -1 on bad arguments or one of ERR_* above.
 int jpeg_decode(void* that, jpeg_read_t read, const void* data,
     int* width, int* height, int* comp, void* output);
 
+int jpeg_decode_ex(void* that, jpeg_read_t read, const void* data,
+    int* width, int* height, int* comp, void* output,
+    const jpeg_decode_options_t* options);
+
+// Decoder context owning all state of a decode: tables, scan state and the
+// 4KB input buffer. Contexts share nothing, one per thread decodes images
+// concurrently. A context is reused across images without reallocation
+// and keeps the Huffman and dequantization tables it built, looked up by
+// the bytes of their DHT and DQT segments, for images repeating them, and
+// the threads of options->threads decodes, joined on destroy.
+typedef struct jpeg_decoder_s jpeg_decoder_t;
+
+jpeg_decoder_t* jpeg_decoder_create(void);
+
+void jpeg_decoder_destroy(jpeg_decoder_t* decoder);
+
+// jpeg_decode_ex() with caller owned context
+int jpeg_decoder_decode(jpeg_decoder_t* decoder, void* that,
+    jpeg_read_t read, const void* data, int* width, int* height, int* comp,
+    void* output, const jpeg_decode_options_t* options);
+
+// Caller owned destination of jpeg_decoder_decode_to(): a w x h canvas the
+// *width x *height output is written into with its top left pixel at x, y.
+// Planar formats put chroma at cb and cr (nv12 Cb Cr pairs at cb) with
+// their samples of the canvas as laid out under jpeg_format_*. yuyv needs
+// x, i420 and nv12 x and y even.
+typedef struct jpeg_decode_target_s {
+    void* pixels;   // packed pixels or Y plane
+    int pitch;      // bytes per row of pixels
+    void* cb;       // planar formats: chroma planes
+    void* cr;
+    int cpitch;     // bytes per row of cb and cr
+    int x, y;       // output origin in the canvas
+    int w, h;       // canvas size in pixels
+} jpeg_decode_target_t;
+
+// jpeg_decoder_decode() into `target` instead of a reallocated picture.
+// Only the output pixels are written, edge MCUs clipped to the image, so
+// the canvas needs no padding. Returns -1 when the output does not fit.
+int jpeg_decoder_decode_to(jpeg_decoder_t* decoder, void* that,
+    jpeg_read_t read, const void* data, int* width, int* height, int* comp,
+    const jpeg_decode_target_t* target, const jpeg_decode_options_t* options);
+
+// Loads the DQT and DHT segments of a table specification (SOI, tables,
+// EOI in `size` bytes at `data`) ahead of abbreviated images: tables an
+// image decoded with the context leaves undefined come from here instead
+// of the previous image (quantization) or the standard MJPEG tables
+// (Huffman). Returns 0, -1 on bad arguments or one of ERR_*.
+int jpeg_decoder_tables(jpeg_decoder_t* decoder, const void* data,
+    int size);
+
+// Frame description read by jpeg_probe()
+typedef struct jpeg_probe_s {
+    int width, height;  // height 0: set by a DNL marker after the scan
+    int precision;      // bits per sample
+    int sof;            // SOFn marker: 0xc0 baseline, 0xc2 progressive...
+    int comp;           // components
+    int id[4];          // component ids
+    int h[4], v[4];     // sampling factors
+    int tq[4];          // quantization table selectors
+    int dri;            // restart interval in MCUs (0: none)
+    int dht;            // Huffman tables defined (0: standard MJPEG ones)
+    int qmask;          // bit n: quantization table n defined
+    int quant[4][64];   // quantization tables in zigzag order
+    int app;            // bit n: APPn segment present
+    long bytes;         // offset of the first SOS marker
+} jpeg_probe_t;
+
+// skips `bytes` of the input, returns 0 or -1
+typedef int (*jpeg_skip_t)(void* that, int bytes);
+
+// Reads the markers up to the first SOS through `read` or, when `read` is
+// NULL, from `size` bytes in memory at `data`, pulling only the bytes it
+// needs: marker and length, then the payload of SOFn, DQT and DRI.
+// Others (APPn, COM, DHT) are passed to `skip`, or read and dropped when
+// it is NULL. Nothing is allocated or decoded. Returns 0, -1 on bad
+// arguments or one of ERR_*.
+int jpeg_probe(void* that, jpeg_read_t read, jpeg_skip_t skip,
+    const void* data, int size, jpeg_probe_t* probe);
+
+// MJPEG stream decoder. jpeg_mjpeg_push() takes the stream in pieces of any
+// size: concatenated JPEG frames (capture buffers, .mjpeg files), an AVI
+// file or a multipart/x-mixed-replace body. Bytes between frames (RIFF and
+// chunk headers, part boundaries) are skipped: a frame starts at SOI and
+// is walked segment by segment to EOI, its entropy coded data scanned 16
+// bytes at a time for markers. With `threads` > 1 as many persistent
+// workers decode frames concurrently, up to 2 * `threads` in flight, each
+// with a context, a copy of its data and a picture of its own kept for
+// later frames (options->threads is not used). Frames are passed to
+// `frame` on the thread calling push or flush, in stream order with
+// `index` counting from 0, as soon as they and those ahead are done.
+// `pic` is laid out as jpeg_decode_ex() output and valid during the call
+// only. Frames that do not decode, run into the next SOI (ERR_NO_EOI) or
+// are cut off by jpeg_mjpeg_flush() (ERR_EOF) come with err != 0 and pic
+// NULL.
+typedef void (*jpeg_frame_t)(void* that, int index, int err,
+    const void* pic, int width, int height, int comp);
+
+typedef struct jpeg_mjpeg_s jpeg_mjpeg_t;
+
+jpeg_mjpeg_t* jpeg_mjpeg_create(int threads,
+    const jpeg_decode_options_t* options, jpeg_frame_t frame, void* that);
+
+void jpeg_mjpeg_destroy(jpeg_mjpeg_t* mjpeg);
+
+// Delivers the frames done so far, waiting only while all 2 * `threads`
+// are in flight. Returns 0 or -1.
+int jpeg_mjpeg_push(jpeg_mjpeg_t* mjpeg, const void* data, int bytes);
+
+// Delivers the frames still held and starts over for a new stream, its
+// `index` from 0 again.
+int jpeg_mjpeg_flush(jpeg_mjpeg_t* mjpeg);
+
+// decodes JPEG in memory `buf` into YUYV *pic reallocated to *width x *height
+int jpeg_decode0(unsigned char** pic, unsigned char* buf,
+    int* width, int* height);
+
 #ifdef __cplusplus
 }
 #endif
@@ -40,84 +223,70 @@ extern "C" {
 #endif
 
 #include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <math.h>
 #include <errno.h>
 
+/* restart intervals decoded in parallel on Win32 or POSIX threads unless
+ * jpeg_decode_no_threads */
+#ifndef jpeg_decode_no_threads
+#define DEC_THREADS
+#define DEC_CHUNK (64 * 1024)    /* least bytes per speculating thread */
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
+#endif
+
+/* SSE2 kernels where the compiler targets it, AVX2 ones compiled in
+ * alongside (jpeg_decode_no_avx2 leaves them out) and picked at run time.
+ * jpeg_decode_no_simd builds the plain C decoder. */
+#if !defined(jpeg_decode_no_simd) && (defined(__SSE2__) || \
+    defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+#include <emmintrin.h>
+#define DEC_SSE2
+#if defined(_MSC_VER) && !defined(__clang__)
+#define DEC_INLINE __forceinline
+#else
+#define DEC_INLINE inline __attribute__((always_inline))
+#endif
+#if !defined(jpeg_decode_no_avx2) && (defined(__x86_64__) || \
+    defined(__i386__) || defined(_M_X64) || defined(_M_IX86))
+#include <immintrin.h>
+#define DEC_AVX2
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>
+#define DEC_AVX2_TARGET
+#else
+#define DEC_AVX2_TARGET __attribute__((target("avx2")))
+#endif
+#endif
+#endif
+
 typedef struct jpeg_reader_s jpeg_reader_t;
 
 typedef struct jpeg_reader_s {
     void* that;
     jpeg_read_t read;
-    size_t bytes;
+    size_t bytes;           /* total bytes pulled through read */
+    const uint8_t* p;       /* next unread byte */
+    const uint8_t* end;     /* end of buffered bytes, of the scan in memory,
+                               NULL: unbounded memory (headers) */
+    int eof;
     uint8_t buffer[4 * 1024];
 } jpeg_reader_t;
 
+static int dec_refill(jpeg_reader_t* r);
 
-static int LutYr[256];
-static int LutYg[256];
-static int LutYb[256];
-static int LutVr[256];
-static int LutVrY[256];
-static int LutUb[256];
-static int LutUbY[256];
-static int LutRv[256];
-static int LutGu[256];
-static int LutGv[256];
-static int LutBu[256];
-
-#define clip(c) (uint8_t)(((c) > 0xFF) ? 0xff : (((c) < 0) ? 0: (c)))
-
-static uint8_t RGB24_TO_Y(uint8_t r, uint8_t g, uint8_t b) {
-    return (uint8_t)(LutYr[r] + LutYg[g] + LutYb[b]);
-}
-
-uint8_t YR_TO_V(uint8_t r, uint8_t y) {
-    return (uint8_t)(LutVr[r] + LutVrY[y]);
-}
-
-uint8_t YB_TO_U(uint8_t b, uint8_t y) {
-    return (uint8_t)(LutUb[b] + LutUbY[y]);
-}
-
-uint8_t R_FROMYV(uint8_t y, uint8_t v) {
-    return clip((y)+LutRv[v]);
-}
+/* next input byte or -1 at end of input */
+#define READBYTE(r) ((r)->p != (r)->end ? *(r)->p++ : dec_refill(r))
 
-uint8_t G_FROMYUV(uint8_t y, uint8_t u, uint8_t v) {
-    return clip((y)+LutGu[u] + LutGv[v]);
-}
 
-uint8_t B_FROMYU(uint8_t y, uint8_t u) {
-    return clip((y)+LutBu[u]);
-}
+#define clip(c) (uint8_t)(((c) > 0xFF) ? 0xff : (((c) < 0) ? 0: (c)))
 
-void initLut(void) {
-    enum {
-        Rcoef = 299,
-        Gcoef = 587,
-        Bcoef = 114,
-        Vrcoef = 711, // 656 // 877
-        Ubcoef = 560, // 500 // 493 564
-        CoefRv = 1402,
-        CoefGu = 714, // 344
-        CoefGv = 344, // 714
-        CoefBu = 1772,
-    };
-    for (int i = 0; i < 256; i++) {
-        LutYr[i] = i * Rcoef / 1000;
-        LutYg[i] = i * Gcoef / 1000;
-        LutYb[i] = i * Bcoef / 1000;
-        LutVr[i] = i * Vrcoef / 1000;
-        LutUb[i] = i * Ubcoef / 1000;
-        LutVrY[i] = 128 - (i * Vrcoef / 1000);
-        LutUbY[i] = 128 - (i * Ubcoef / 1000);
-        LutRv[i] = (i - 128) * CoefRv / 1000;
-        LutBu[i] = (i - 128) * CoefBu / 1000;
-        LutGu[i] = (128 - i) * CoefGu / 1000;
-        LutGv[i] = (128 - i) * CoefGv / 1000;
-    }
-}
 
 
 #define DHT_SIZE 432
@@ -170,7 +339,7 @@ static unsigned char dht_data[DHT_SIZE] = {
 
 #define JPG_HUFFMAN_TABLE_LENGTH 0x1A0
 
-const unsigned char JPEGHuffmanTable[JPG_HUFFMAN_TABLE_LENGTH]
+static const unsigned char JPEGHuffmanTable[JPG_HUFFMAN_TABLE_LENGTH]
     = {
     0x00, 0x00, 0x01, 0x05, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x00,
     0x00, 0x00, 0x00, 0x00, 0x00,
@@ -235,19 +404,46 @@ const unsigned char JPEGHuffmanTable[JPG_HUFFMAN_TABLE_LENGTH]
 #define M_BADHUFF    -1
 #define M_EOF        0x80
 
+/* IDCT of a block with nonzero coefficients in the top left n x n */
+typedef void (*idct_kernel_t)(const int16_t* in, uint8_t* out,
+                              const int16_t* quant, int n);
+
+/* dequantization table scaled for the inverse DCT */
+union dec_quant {
+    int d[64];              /* jpeg_dct_fast */
+    int16_t a[64];          /* jpeg_dct_accurate */
+    float f[64];            /* jpeg_dct_float */
+};
+
 struct jpeg_decdata {
-    int dcts[6 * 64 + 16];
-    int out[64 * 6];
-    int dquant[3][64];
+    int16_t dcts[6 * 64];   /* coefficients in natural order */
+    uint8_t out[64 * 6];    /* samples of 4 Y, Cb and Cr blocks */
+    const union dec_quant* quant[3];    /* Y, Cb, Cr in the table cache */
+    idct_kernel_t islow;    /* jpeg_dct_accurate kernel for this CPU */
+    int dct;                /* jpeg_dct_* */
+    int format;             /* jpeg_format_* */
+    int hs, vs;             /* luma blocks per MCU horizontally, vertically */
+    int bs, bsh;            /* output samples per block side (8 / scale), log2 */
+    int cbs;                /* the same of Cb and Cr blocks */
+    int chs, cvs;           /* log2 output pixels per chroma sample */
+    int rx, ry;             /* crop window origin, width x height from it */
+    int pw, ph;             /* (scaled) picture the window is in */
+    int chroma;             /* Cb and Cr blocks reconstructed */
+    uint8_t* pic;           /* output picture, Y plane of planar formats */
+    int pitch;              /* bytes per output row */
+    int width, height;
+    uint8_t* cb;            /* planar formats: chroma planes */
+    uint8_t* cr;
+    int cpitch;             /* bytes per chroma row */
+    int cstep;              /* bytes between chroma samples in a row */
+    int cx, cy;             /* chroma subsampling: pixels per sample */
 };
 
 typedef struct in_s {
-    uint8_t* p;
-    uint32_t bits;
+    jpeg_reader_t* reader;
+    uint64_t bits;
     int left;
     int marker;
-    int(*func)(void*);
-    void* data;
 } in_t;
 
 struct dec_hufftbl;
@@ -273,37 +469,57 @@ struct scan {
 
 #define DECBITS 10        /* seems to be the optimum */
 
+/* Codes up to DECBITS long resolve in llvals, the rest in the second level
+ * longvals indexed by their 16 bit left justified code less longbase: long
+ * codes are the last ones of a canonical code and at most 256 of 11 bits or
+ * more span no more than 256 * 32 values. */
 struct dec_hufftbl {
-    int maxcode[17];
-    int valptr[16];
-    uint8_t vals[256];
-    uint32_t llvals[1 << DECBITS];
+    uint64_t llvals[1 << DECBITS];
+    int longbase, nlong;
+    uint16_t longvals[256 * 32];    /* code length << 8 | symbol, 0: none */
 };
 
-static int huffman_init(void);
+static void huffman_init(jpeg_decoder_t* d);
 
-static void decode_mcus(in_t*, int*, int, struct scan*, int*);
+static void decode_mcus(in_t*, int16_t*, int, struct scan*, int*);
 
 static int dec_readmarker(in_t*);
 
-static void dec_makehuff(struct dec_hufftbl*, int*, uint8_t*);
+static void dec_makehuff(struct dec_hufftbl*, int*, uint8_t*, int);
 
-static void setinput(in_t*, uint8_t*);
+static void setinput(in_t*, jpeg_reader_t*);
+
+static int fillbits(in_t*, int, uint64_t);
 
 #undef PREC
 #define PREC int
 
-static void idctqtab(uint8_t*, PREC*);
+static void idctqtab(const uint8_t*, PREC*);
+
+inline static void idct(const int16_t* in, uint8_t* out, const int* quant,
+                        int max);
 
-inline static void idct(int* in, int* out, int* quant, long off, int max);
+static void idct_tables(int dct, const uint8_t* qin, union dec_quant* q);
+
+static void idct_block(struct jpeg_decdata* decdata, const int16_t* in,
+                       uint8_t* out, int c, int max);
 
 int is_huffman(uint8_t* buf);
 
-static void yuv420pto422(int* out, uint8_t* pic, int width);
-static void yuv422pto422(int* out, uint8_t* pic, int width);
-static void yuv444pto422(int* out, uint8_t* pic, int width);
-static void yuv400pto422(int* out, uint8_t* pic, int width);
-typedef void (*ftopict) (int* out, uint8_t* pic, int width);
+static int dec_bpp(int format);
+
+static size_t dec_size(int format, int width, int height);
+
+static void dec_planes(jpeg_decode_target_t* t, int format, uint8_t* pic,
+                       int w, int h);
+
+static int dec_target(struct jpeg_decdata* decdata,
+                      const jpeg_decode_target_t* t);
+
+static int dec_window(struct jpeg_decdata* decdata,
+                      const jpeg_decode_options_t* options, int* w, int* h);
+
+static void dec_output(struct jpeg_decdata* decdata, int x, int y);
 
 #define M_SOI    0xd8
 #define M_APP0    0xe0
@@ -316,19 +532,18 @@ typedef void (*ftopict) (int* out, uint8_t* pic, int width);
 #define M_EOI    0xd9
 #define M_COM    0xfe
 
-static uint8_t* datap;
-
-static uint8_t getbyte(void)
-{
-    return *datap++;
-}
-
-static int getword(void)
-{
-    int c1, c2;
-    c1 = *datap++;
-    c2 = *datap++;
-    return c1 << 8 | c2;
+static int dec_refill(jpeg_reader_t* r) {
+    int n = 0;
+    if (r->read != NULL && !r->eof)
+        n = r->read(r->that, r->buffer, (int)sizeof(r->buffer));
+    if (n <= 0) {
+        r->eof = 1;
+        return -1;
+    }
+    r->bytes += (size_t)n;
+    r->p = r->buffer;
+    r->end = r->buffer + n;
+    return *r->p++;
 }
 
 struct comp {
@@ -342,31 +557,141 @@ struct jpginfo {
     int nc;            /* number of components */
     int ns;            /* number of scans */
     int dri;            /* restart interval */
-    int nm;            /* mcus til next marker */
     int rm;            /* next restart marker */
 };
 
-static struct jpginfo info;
-static struct comp comps[MAXCOMP];
+#define DEC_HCACHE 12    /* built Huffman tables kept by a context */
+#define DEC_QCACHE 8     /* scaled dequantization tables kept */
+
+/* Huffman table built from the DHT bytes `raw`: Tc Th, the 16 code counts
+ * and the symbols */
+struct dec_hentry {
+    uint32_t key;           /* hash of raw */
+    uint32_t used;          /* tick of the last lookup, 0: empty */
+    int n;                  /* bytes of raw */
+    int pin;                /* preloaded, never evicted */
+    uint8_t raw[1 + 16 + 256];
+    struct dec_hufftbl t;
+};
+
+/* dequantization table of the DQT bytes `raw` scaled for `dct` */
+struct dec_qentry {
+    uint32_t key;
+    uint32_t used;
+    int dct;
+    uint8_t raw[64];
+    union dec_quant q;
+};
+
+/* everything a decode touches, nothing is kept in globals */
+struct jpeg_decoder_s {
+    struct jpginfo info;
+    struct comp comps[MAXCOMP];
+    struct scan dscans[MAXCOMP];
+    uint8_t quant_table[4][64];
+    struct dec_hufftbl* dhuff[4];   /* dc0 dc1 ac0 ac1, NULL: undefined */
+    struct dec_hufftbl* hpre[4];    /* preloaded by jpeg_decoder_tables() */
+    uint8_t qpre[4][64];            /* and its quant_table */
+    int qdef, qmask;                /* quant_table defined, preloaded */
+    uint32_t tick;                  /* cache lookups */
+    struct dec_hentry hcache[DEC_HCACHE];
+    struct dec_qentry qcache[DEC_QCACHE];
+    struct jpeg_decdata decdata;
+    in_t input;
+    jpeg_reader_t reader;
+#ifdef DEC_THREADS
+    struct dec_pool* pool;          /* threads kept for parallel decodes */
+#endif
+};
+
+static int getbyte(jpeg_decoder_t* d)
+{
+    return READBYTE(&d->reader);
+}
 
-static struct scan dscans[MAXCOMP];
+static int getword(jpeg_decoder_t* d)
+{
+    int c1, c2;
+    c1 = getbyte(d);
+    c2 = getbyte(d);
+    return c1 << 8 | c2;
+}
 
-static uint8_t quant_table[4][64];
+/* FNV-1a of n bytes, the key of cached tables */
+static uint32_t dec_hash(const uint8_t* p, int n) {
+    uint32_t h = 2166136261u;
+    while (n-- > 0)
+        h = (h ^ *p++) * 16777619u;
+    return h;
+}
 
-static struct dec_hufftbl dhuff[4];
+/* Table of the DHT bytes raw[0..n) from the cache, else built in the least
+ * recently used entry that is neither preloaded nor in a slot (at most 8
+ * of DEC_HCACHE) */
+static struct dec_hufftbl* dec_huff(jpeg_decoder_t* d, const uint8_t* raw,
+                                    int n) {
+    struct dec_hentry *e, *lru = NULL;
+    uint32_t key = dec_hash(raw, n);
+    int hufflen[16], i, j;
+    for (i = 0; i < DEC_HCACHE; i++) {
+        e = d->hcache + i;
+        if (e->used != 0 && e->key == key && e->n == n &&
+            memcmp(e->raw, raw, n) == 0) {
+            e->used = ++d->tick;
+            return &e->t;
+        }
+        if (e->pin || (lru != NULL && e->used >= lru->used))
+            continue;
+        for (j = 0; j < 4 && d->dhuff[j] != &e->t; j++)
+            ;
+        if (j == 4)
+            lru = e;
+    }
+    lru->key = key;
+    lru->used = ++d->tick;
+    lru->n = n;
+    memcpy(lru->raw, raw, n);
+    for (i = 0; i < 16; i++)
+        hufflen[i] = raw[1 + i];
+    dec_makehuff(&lru->t, hufflen, lru->raw + 17, raw[0] >> 4);
+    return &lru->t;
+}
 
-#define dec_huffdc (dhuff + 0)
-#define dec_huffac (dhuff + 2)
+/* Points the dequantization of component c at DQT bytes qin scaled for the
+ * IDCT, from the cache or made in its least recently used entry */
+static void dec_qtab(jpeg_decoder_t* d, const uint8_t* qin, int c) {
+    struct dec_qentry *e, *lru = d->qcache;
+    int dct = d->decdata.dct;
+    uint32_t key = dec_hash(qin, 64);
+    int i;
+    for (i = 0; i < DEC_QCACHE; i++) {
+        e = d->qcache + i;
+        if (e->used != 0 && e->key == key && e->dct == dct &&
+            memcmp(e->raw, qin, 64) == 0)
+            break;
+        if (e->used < lru->used)
+            lru = e;
+    }
+    if (i == DEC_QCACHE) {
+        e = lru;
+        e->key = key;
+        e->dct = dct;
+        memcpy(e->raw, qin, 64);
+        idct_tables(dct, qin, &e->q);
+    }
+    e->used = ++d->tick;
+    d->decdata.quant[c] = &e->q;
+}
 
-static int readtables(int till, int* isDHT)
+static int readtables(jpeg_decoder_t* d, int till)
 {
     int m, l, i, j, lq, pq, tq;
     int tc, th, tt;
 
     for (;;) {
-        if (getbyte() != 0xff)
+        if (getbyte(d) != 0xff)
             return -1;
-        if ((m = getbyte()) == till)
+        if ((m = getbyte(d)) == till)
             break;
 
         switch (m) {
@@ -375,9 +700,9 @@ static int readtables(int till, int* isDHT)
 
         case M_DQT:
             //printf("find DQT \n");
-            lq = getword();
+            lq = getword(d);
             while (lq > 2) {
-                pq = getbyte();
+                pq = getbyte(d);
                 tq = pq & 15;
                 if (tq > 3)
                     return -1;
@@ -385,48 +710,49 @@ static int readtables(int till, int* isDHT)
                 if (pq != 0)
                     return -1;
                 for (i = 0; i < 64; i++)
-                    quant_table[tq][i] = getbyte();
+                    d->quant_table[tq][i] = getbyte(d);
+                d->qdef |= 1 << tq;
                 lq -= 64 + 1;
             }
             break;
 
         case M_DHT:
             //printf("find DHT \n");
-            l = getword();
+            l = getword(d);
             while (l > 2) {
-                int hufflen[16], k;
-                uint8_t huffvals[256];
+                uint8_t raw[1 + 16 + 256];
 
-                tc = getbyte();
+                tc = getbyte(d);
+                raw[0] = (uint8_t)tc;
                 th = tc & 15;
                 tc >>= 4;
                 tt = tc * 2 + th;
                 if (tc > 1 || th > 1)
                     return -1;
-                for (i = 0; i < 16; i++)
-                    hufflen[i] = getbyte();
-                l -= 1 + 16;
-                k = 0;
+                j = 0;
                 for (i = 0; i < 16; i++) {
-                    for (j = 0; j < hufflen[i]; j++)
-                        huffvals[k++] = getbyte();
-                    l -= hufflen[i];
+                    raw[1 + i] = (uint8_t)getbyte(d);
+                    j += raw[1 + i];
                 }
-                dec_makehuff(dhuff + tt, hufflen, huffvals);
+                if (j > 256)
+                    return -1;
+                for (i = 0; i < j; i++)
+                    raw[17 + i] = (uint8_t)getbyte(d);
+                l -= 1 + 16 + j;
+                d->dhuff[tt] = NULL;    /* free to be evicted */
+                d->dhuff[tt] = dec_huff(d, raw, 17 + j);
             }
-            *isDHT = 1;
             break;
 
         case M_DRI:
-            printf("find DRI \n");
-            l = getword();
-            info.dri = getword();
+            l = getword(d);
+            d->info.dri = getword(d);
             break;
 
         default:
-            l = getword();
+            l = getword(d);
             while (l-- > 2)
-                getbyte();
+                getbyte(d);
             break;
         }
     }
@@ -434,351 +760,947 @@ static int readtables(int till, int* isDHT)
     return 0;
 }
 
-static void dec_initscans(void) {
-    int i;
-    info.nm = info.dri + 1;
-    info.rm = M_RST0;
-    for (i = 0; i < info.ns; i++)
-        dscans[i].dc = 0;
+/* End of the entropy coded data of the scan at p: past the first marker
+ * other than RSTn. Bounds the bit reader's 8 byte loads from memory. */
+static const uint8_t* dec_scanend(const uint8_t* p) {
+    int m;
+    for (;;) {
+        while (*p != 0xff)
+            p++;
+        while (*p == 0xff)    /* fill bytes */
+            p++;
+        m = *p++;
+        if (m != 0 && (m & ~0x07) != M_RST0)
+            return p;
+    }
 }
 
-static in_t input;
+static void dec_initscans(jpeg_decoder_t* d) {
+    int i;
+    d->info.rm = M_RST0;
+    for (i = 0; i < d->info.ns; i++)
+        d->dscans[i].dc = 0;
+}
 
-static int dec_checkmarker(void) {
+static int dec_checkmarker(jpeg_decoder_t* d) {
     int i;
-    if (dec_readmarker(&input) != info.rm)
+    if (dec_readmarker(&d->input) != d->info.rm)
         return -1;
-    info.nm = info.dri;
-    info.rm = (info.rm + 1) & ~0x08;
-    for (i = 0; i < info.ns; i++)
-        dscans[i].dc = 0;
+    d->info.rm = (d->info.rm + 1) & ~0x08;
+    for (i = 0; i < d->info.ns; i++)
+        d->dscans[i].dc = 0;
     return 0;
 }
 
-int jpeg_decode0(uint8_t** pic, uint8_t* buf, int* width, int* height) {
+/* Decodes MCUs m to n - 1 in raster order, all of one restart interval.
+ * Returns 1 when it stopped below the crop window. */
+static int dec_interval(struct jpeg_decdata* decdata, in_t* in,
+                        struct scan* sc, int mb, int mcusx, int m, int n) {
+    int mcuw = decdata->bs * decdata->hs, mcuh = decdata->bs * decdata->vs;
+    int x, y;
+    int max[6];
+    for (; m < n; m++) {
+        x = m % mcusx * mcuw;
+        y = m / mcusx * mcuh;
+        if (y >= decdata->ry + decdata->height)
+            return 1;
+        decode_mcus(in, decdata->dcts, mb, sc, max);
+        if (x >= decdata->rx + decdata->width || x + mcuw <= decdata->rx ||
+            y + mcuh <= decdata->ry)
+            continue;    /* outside the crop window */
+        switch (mb) {
+        case 6: {
+            idct_block(decdata, decdata->dcts, decdata->out, 0, max[0]);
+            idct_block(decdata, decdata->dcts + 64, decdata->out + 64,
+                0, max[1]);
+            idct_block(decdata, decdata->dcts + 128, decdata->out + 128,
+                0, max[2]);
+            idct_block(decdata, decdata->dcts + 192, decdata->out + 192,
+                0, max[3]);
+            if (!decdata->chroma)
+                break;
+            idct_block(decdata, decdata->dcts + 256, decdata->out + 256,
+                1, max[4]);
+            idct_block(decdata, decdata->dcts + 320, decdata->out + 320,
+                2, max[5]);
+
+        } break;
+        case 4:
+        {
+            idct_block(decdata, decdata->dcts, decdata->out, 0, max[0]);
+            idct_block(decdata, decdata->dcts + 64, decdata->out + 64,
+                0, max[1]);
+            if (!decdata->chroma)
+                break;
+            idct_block(decdata, decdata->dcts + 128, decdata->out + 256,
+                1, max[2]);
+            idct_block(decdata, decdata->dcts + 192, decdata->out + 320,
+                2, max[3]);
+
+        }
+        break;
+        case 3:
+            idct_block(decdata, decdata->dcts, decdata->out, 0, max[0]);
+            if (!decdata->chroma)
+                break;
+            idct_block(decdata, decdata->dcts + 64, decdata->out + 256,
+                1, max[1]);
+            idct_block(decdata, decdata->dcts + 128, decdata->out + 320,
+                2, max[2]);
+
+
+            break;
+        case 1:
+            idct_block(decdata, decdata->dcts, decdata->out, 0, max[0]);
+
+            break;
+
+        } // switch enc411
+        dec_output(decdata, x, y);
+    }
+    return 0;
+}
+
+#ifdef DEC_THREADS
+/* Starts of restart intervals s0 to n - 1 of the entropy coded data at p
+ * to seg[]. With `eoi` the data has to end in EOI after interval n - 1,
+ * which seg[n - s0] then points at. */
+static int dec_intervals(const uint8_t* p, int s0, int n, int eoi,
+                         const uint8_t** seg) {
+    int s = 0, m, rm = M_RST0;
+    for (;;) {
+        if (s >= s0)
+            seg[s - s0] = p;
+        if (++s == n && !eoi)
+            return 0;
+        for (;;) {
+            while (*p != 0xff)
+                p++;
+            while (*p == 0xff)    /* fill bytes */
+                p++;
+            m = *p++;
+            if (m != 0)
+                break;
+        }
+        if (s == n) {
+            seg[n - s0] = p - 2;
+            return m == M_EOI ? 0 : ERR_NO_EOI;
+        }
+        if (m != rm)
+            return ERR_WRONG_MARKER;
+        rm = (rm + 1) & ~0x08;
+    }
+}
+
+/* bit position and DC predictors at the start of an MCU */
+struct dec_mcupos {
+    int64_t pos;
+    int dc[MAXCOMP];
+};
+
+/* A thread's share of the scan with its own bit reader, DC predictors and
+ * coefficient and sample buffers: a run of restart intervals or a chunk of
+ * speculatively decoded data without them. */
+struct dec_worker {
+    struct jpeg_decdata decdata;
+    struct scan dscans[MAXCOMP];
+    jpeg_reader_t reader;
+    in_t input;
+    void (*work)(struct dec_worker* w);
+    int mb, mcusx, dri, mcus, ns;
+    const uint8_t** seg;    /* interval starts */
+    int s0, s1;             /* intervals s0 to s1 - 1 */
+    /* speculative decoding, bit positions from base */
+    struct dec_worker* all; /* every chunk, nw of them */
+    int nw, index;
+    const uint8_t* base;
+    int64_t start, end;     /* chunk, decoding guesses an MCU at start */
+    struct dec_mcupos* trace;   /* MCUs starting in the chunk */
+    int n, cap;
+    int done;               /* reached the end of the data */
+    int fail;
+    int sync, sidx, cnt;    /* path joins all[sync].trace[sidx] cnt MCUs on */
+    int dc[MAXCOMP];        /* its DC predictors there */
+    int64_t pos0, next;     /* region: MCUs m0 to m1 - 1 from pos0 to next */
+    int dc0[MAXCOMP];
+    int m0, m1;
+    jpeg_mjpeg_t* mjpeg;    /* stream a persistent worker decodes for */
+    struct dec_pool* pool;  /* pool a persistent thread serves */
+};
+
+/* Decodes intervals s0 to s1 - 1, each of which has to end in its RSTn
+ * (EOI for the last of the scan) as in the sequential loop. The first that
+ * does not sets fail to the error of the decode and stops it. */
+static void dec_work(struct dec_worker* w) {
+    int s, i, m;
+    for (s = w->s0; s < w->s1; s++) {
+        w->reader.p = w->seg[s];
+        setinput(&w->input, &w->reader);
+        for (i = 0; i < w->ns; i++)
+            w->dscans[i].dc = 0;
+        m = s * w->dri;
+        if (dec_interval(&w->decdata, &w->input, w->dscans, w->mb, w->mcusx,
+                m, m + w->dri < w->mcus ? m + w->dri : w->mcus))
+            return;    /* below the crop window */
+        m = dec_readmarker(&w->input);
+        if (s + 1 < (w->mcus + w->dri - 1) / w->dri) {
+            if (m != (M_RST0 | (s & 7))) {
+                w->fail = ERR_WRONG_MARKER;
+                return;
+            }
+        } else if (m != M_EOI) {
+            w->fail = m == M_EOF ? ERR_EOF : ERR_NO_EOI;
+            return;
+        }
+    }
+}
+
+#ifdef _WIN32
+typedef HANDLE dec_thread_t;
+
+static DWORD WINAPI dec_thread_main(LPVOID w) {
+    ((struct dec_worker*)w)->work((struct dec_worker*)w);
+    return 0;
+}
+
+static int dec_thread_start(dec_thread_t* t, struct dec_worker* w) {
+    *t = CreateThread(NULL, 0, dec_thread_main, w, 0, NULL);
+    return *t != NULL ? 0 : -1;
+}
+
+static void dec_thread_join(dec_thread_t t) {
+    WaitForSingleObject(t, INFINITE);
+    CloseHandle(t);
+}
+
+typedef CRITICAL_SECTION dec_mutex_t;
+typedef CONDITION_VARIABLE dec_cond_t;
+
+static void dec_mutex_init(dec_mutex_t* x) { InitializeCriticalSection(x); }
+static void dec_mutex_destroy(dec_mutex_t* x) { DeleteCriticalSection(x); }
+static void dec_lock(dec_mutex_t* x) { EnterCriticalSection(x); }
+static void dec_unlock(dec_mutex_t* x) { LeaveCriticalSection(x); }
+static void dec_cond_init(dec_cond_t* c) { InitializeConditionVariable(c); }
+static void dec_cond_destroy(dec_cond_t* c) { (void)c; }
+static void dec_wake(dec_cond_t* c) { WakeConditionVariable(c); }
+static void dec_wake_all(dec_cond_t* c) { WakeAllConditionVariable(c); }
+
+static void dec_wait(dec_cond_t* c, dec_mutex_t* x) {
+    SleepConditionVariableCS(c, x, INFINITE);
+}
+#else
+typedef pthread_t dec_thread_t;
+
+static void* dec_thread_main(void* w) {
+    ((struct dec_worker*)w)->work((struct dec_worker*)w);
+    return NULL;
+}
+
+static int dec_thread_start(dec_thread_t* t, struct dec_worker* w) {
+    return pthread_create(t, NULL, dec_thread_main, w) == 0 ? 0 : -1;
+}
+
+static void dec_thread_join(dec_thread_t t) {
+    pthread_join(t, NULL);
+}
+
+typedef pthread_mutex_t dec_mutex_t;
+typedef pthread_cond_t dec_cond_t;
+
+static void dec_mutex_init(dec_mutex_t* x) { pthread_mutex_init(x, NULL); }
+static void dec_mutex_destroy(dec_mutex_t* x) { pthread_mutex_destroy(x); }
+static void dec_lock(dec_mutex_t* x) { pthread_mutex_lock(x); }
+static void dec_unlock(dec_mutex_t* x) { pthread_mutex_unlock(x); }
+static void dec_cond_init(dec_cond_t* c) { pthread_cond_init(c, NULL); }
+static void dec_cond_destroy(dec_cond_t* c) { pthread_cond_destroy(c); }
+static void dec_wake(dec_cond_t* c) { pthread_cond_signal(c); }
+static void dec_wake_all(dec_cond_t* c) { pthread_cond_broadcast(c); }
+
+static void dec_wait(dec_cond_t* c, dec_mutex_t* x) {
+    pthread_cond_wait(c, x);
+}
+#endif
+
+/* Threads a context keeps for its parallel decodes, started as a run
+ * first needs them. A run hands its workers out to them and the calling
+ * thread in order. */
+struct dec_pool {
+    struct dec_worker self;     /* every pool thread starts on it */
+    dec_thread_t* th;
+    int threads;                /* started */
+    dec_mutex_t lock;           /* guards the fields below */
+    dec_cond_t work, done;
+    struct dec_worker* w;       /* workers of the run, NULL between runs */
+    int next, n;                /* next worker handed out, workers */
+    int busy;                   /* handed out and not finished */
+    int stop;
+};
+
+/* next worker of the run, NULL when all are handed out; locked */
+static struct dec_worker* dec_take(struct dec_pool* p) {
+    if (p->w == NULL || p->next >= p->n)
+        return NULL;
+    p->busy++;
+    return p->w + p->next++;
+}
+
+static void dec_pool_work(struct dec_worker* self) {
+    struct dec_pool* p = self->pool;
+    struct dec_worker* w = NULL;
+    dec_lock(&p->lock);
+    for (;;) {
+        while (!p->stop && (w = dec_take(p)) == NULL)
+            dec_wait(&p->work, &p->lock);
+        if (p->stop)
+            break;
+        dec_unlock(&p->lock);
+        w->work(w);
+        dec_lock(&p->lock);
+        if (--p->busy == 0 && p->next >= p->n)
+            dec_wake(&p->done);
+    }
+    dec_unlock(&p->lock);
+}
+
+static void dec_pool_destroy(struct dec_pool* p) {
+    int i;
+    if (p == NULL)
+        return;
+    dec_lock(&p->lock);
+    p->stop = 1;
+    dec_wake_all(&p->work);
+    dec_unlock(&p->lock);
+    for (i = 0; i < p->threads; i++)
+        dec_thread_join(p->th[i]);
+    dec_cond_destroy(&p->done);
+    dec_cond_destroy(&p->work);
+    dec_mutex_destroy(&p->lock);
+    free(p->th);
+    free(p);
+}
+
+/* runs the t workers on the context's pool, the first on the calling
+ * thread, which also takes those no pool thread has taken */
+static void dec_run(jpeg_decoder_t* d, struct dec_worker* w, int t) {
+    struct dec_pool* p = d->pool;
+    struct dec_worker* v;
+    dec_thread_t* th;
+    int i;
+    if (p == NULL) {
+        p = (struct dec_pool*)calloc(1, sizeof(*p));
+        if (p == NULL) {
+            for (i = 0; i < t; i++)
+                w[i].work(w + i);
+            return;
+        }
+        p->self.work = dec_pool_work;
+        p->self.pool = p;
+        dec_mutex_init(&p->lock);
+        dec_cond_init(&p->work);
+        dec_cond_init(&p->done);
+        d->pool = p;
+    }
+    if (p->threads < t - 1) {
+        th = (dec_thread_t*)realloc(p->th, (size_t)(t - 1) * sizeof(*th));
+        if (th != NULL) {
+            p->th = th;
+            while (p->threads < t - 1 &&
+                   dec_thread_start(p->th + p->threads, &p->self) == 0)
+                p->threads++;
+        }
+    }
+    dec_lock(&p->lock);
+    p->w = w;
+    p->n = t;
+    p->next = 1;
+    dec_wake_all(&p->work);
+    dec_unlock(&p->lock);
+    w->work(w);
+    dec_lock(&p->lock);
+    while ((v = dec_take(p)) != NULL) {
+        dec_unlock(&p->lock);
+        v->work(v);
+        dec_lock(&p->lock);
+        p->busy--;
+    }
+    while (p->busy > 0)
+        dec_wait(&p->done, &p->lock);
+    p->w = NULL;
+    dec_unlock(&p->lock);
+}
+
+/* t workers sharing the decoder's tables */
+static struct dec_worker* dec_workers(jpeg_decoder_t* d, int t, int mb,
+                                      int mcusx, int mcus) {
+    struct dec_worker* w;
+    int i;
+    w = (struct dec_worker*)calloc((size_t)t, sizeof(*w));
+    if (w == NULL)
+        return NULL;
+    for (i = 0; i < t; i++) {
+        w[i].decdata = d->decdata;
+        memcpy(w[i].dscans, d->dscans, sizeof(d->dscans));
+        w[i].reader.end = d->reader.end;
+        w[i].mb = mb;
+        w[i].mcusx = mcusx;
+        w[i].dri = d->info.dri;
+        w[i].mcus = mcus;
+        w[i].ns = d->info.ns;
+        w[i].all = w;
+        w[i].nw = t;
+        w[i].index = i;
+    }
+    return w;
+}
+
+/* Decodes the mcus MCUs following the scan header of an in memory image
+ * with restart intervals on up to `threads` threads. The intervals are
+ * located up front and split into a contiguous run per thread, the calling
+ * thread taking the first. Intervals above the crop window are entropy
+ * decoded only, to check their markers as the sequential loop does, those
+ * below it not scanned for. Returns 0 or the error of the first interval
+ * not ending in its marker. */
+static int dec_parallel(jpeg_decoder_t* d, int mb, int mcusx, int mcus,
+                        int threads) {
+    struct jpeg_decdata* decdata = &d->decdata;
+    int dri = d->info.dri, mcuh = decdata->bs * decdata->vs;
+    int n = (mcus + dri - 1) / dri, end, i, t, err;
+    const uint8_t** seg;
+    struct dec_worker* w;
+    /* MCU rows up to the bottom of the window */
+    end = (decdata->ry + decdata->height + mcuh - 1) / mcuh * mcusx;
+    if (end < mcus)
+        n = (end + dri - 1) / dri;
+    seg = (const uint8_t**)malloc((size_t)(n + 1) * sizeof(*seg));
+    if (seg == NULL)
+        return -1;
+    err = dec_intervals(d->reader.p, 0, n, end >= mcus, seg);
+    if (err) {
+        free(seg);
+        return err;
+    }
+    t = threads < n ? threads : n;
+    w = dec_workers(d, t, mb, mcusx, mcus);
+    if (w == NULL) {
+        free(seg);
+        return -1;
+    }
+    for (i = 0; i < t; i++) {
+        w[i].work = dec_work;
+        w[i].seg = seg;
+        w[i].s0 = (int)((int64_t)n * i / t);
+        w[i].s1 = (int)((int64_t)n * (i + 1) / t);
+    }
+    dec_run(d, w, t);
+    err = 0;
+    for (i = 0; i < t && err == 0; i++)    /* the first in the stream */
+        err = w[i].fail;
+    free(w);
+    free(seg);
+    return err;
+}
+
+/* Position of the next unread bit from base: bytes holding the bits left
+ * in the register are stepped back over, stuffed zeros and all. */
+static int64_t dec_bitpos(const in_t* in, const uint8_t* base) {
+    const uint8_t* q = in->reader->p;
+    int n = in->left;
+    while (n > 0) {
+        q--;
+        if (*q == 0 && q > base && q[-1] == 0xff)
+            q--;
+        n -= 8;
+    }
+    return (int64_t)(q - base) * 8 - n;
+}
+
+/* restarts the bit reader at pos */
+static void dec_seek(struct dec_worker* w, int64_t pos) {
+    w->reader.eof = 0;
+    w->reader.p = w->base + (pos >> 3);
+    setinput(&w->input, &w->reader);
+    w->input.left = fillbits(&w->input, 0, 0) - (int)(pos & 7);
+}
+
+/* Entropy decodes the chunk from a guessed MCU start, noting where each MCU
+ * begins. A bad code proves the guess wrong, decoding starts over a byte
+ * on. The first chunk starts at the true start. */
+static void dec_spec_chunk(struct dec_worker* w) {
+    struct dec_mcupos* p;
+    int64_t pos, start = w->start;
+    int i, max[6];
+    w->sync = -1;
+    for (;;) {
+        dec_seek(w, start);
+        for (i = 0; i < w->ns; i++)
+            w->dscans[i].dc = 0;
+        w->n = 0;
+        for (;;) {
+            pos = dec_bitpos(&w->input, w->base);
+            if (pos >= w->end)
+                return;
+            if (w->n == w->cap) {
+                w->cap = w->cap ? w->cap * 2 : 256;
+                p = (struct dec_mcupos*)realloc(w->trace,
+                    (size_t)w->cap * sizeof(*p));
+                if (p == NULL) {
+                    w->fail = 1;
+                    return;
+                }
+                w->trace = p;
+            }
+            w->trace[w->n].pos = pos;
+            for (i = 0; i < w->ns; i++)
+                w->trace[w->n].dc[i] = w->dscans[i].dc;
+            w->n++;
+            decode_mcus(&w->input, w->decdata.dcts, w->mb, w->dscans, max);
+            if (w->input.marker == M_BADHUFF)
+                break;
+            if (w->input.marker) {
+                w->done = 1;
+                return;
+            }
+        }
+        if (w->index == 0) {
+            w->fail = 1;    /* the data is corrupt */
+            return;
+        }
+        start = ((pos >> 3) + 1) * 8;
+        if (w->base[(start >> 3) - 1] == 0xff)
+            start += 8;    /* not on a stuffed zero */
+        if (start >= w->end) {
+            w->n = 0;
+            return;
+        }
+    }
+}
+
+/* Follows the chunk's path on into the next chunks until it meets an MCU
+ * start of theirs: from there on their decoding is on the same path. */
+static void dec_spec_walk(struct dec_worker* w) {
+    struct dec_worker* u;
+    int64_t pos;
+    int i, k = 0, max[6];
+    if (w->done || w->fail || w->index + 1 == w->nw)
+        return;
+    u = w + 1;
+    for (w->cnt = 0; w->cnt < w->mcus; w->cnt++) {
+        pos = dec_bitpos(&w->input, w->base);
+        while (u + 1 < w->all + w->nw && pos >= u[1].start) {
+            u++;
+            k = 0;
+        }
+        while (k < u->n && u->trace[k].pos < pos)
+            k++;
+        if (k < u->n && u->trace[k].pos == pos) {
+            w->sync = (int)(u - w->all);
+            w->sidx = k;
+            for (i = 0; i < w->ns; i++)
+                w->dc[i] = w->dscans[i].dc;
+            return;
+        }
+        decode_mcus(&w->input, w->decdata.dcts, w->mb, w->dscans, max);
+        if (w->input.marker)
+            return;
+    }
+}
+
+/* Decodes the chunk's region for real, checking it ends where the next
+ * one starts, or in EOI for the last. */
+static void dec_spec_region(struct dec_worker* w) {
+    int i;
+    if (w->m0 >= w->m1)
+        return;
+    dec_seek(w, w->pos0);
+    for (i = 0; i < w->ns; i++)
+        w->dscans[i].dc = w->dc0[i];
+    if (dec_interval(&w->decdata, &w->input, w->dscans, w->mb, w->mcusx,
+            w->m0, w->m1))
+        w->fail = w->input.marker == M_BADHUFF;    /* below the window */
+    else if (w->m1 < w->mcus)
+        w->fail = w->input.marker ||
+            dec_bitpos(&w->input, w->base) != w->next;
+    else
+        w->fail = dec_readmarker(&w->input) != M_EOI;
+}
+
+/* Decodes the mcus MCUs of an in memory image without restart intervals
+ * on up to `threads` threads by speculation (Klein and Wiseman): the data
+ * is cut into chunks each thread decodes from a guessed MCU start. Huffman
+ * codes resynchronize, so a chunk's path soon meets the true one and the
+ * previous chunk's path followed on into it finds where. Chained from the
+ * start, that splits the scan into regions of known start, MCU and DC
+ * predictors decoded in parallel. Returns 1 for a sequential decode when
+ * the data is too short or anything does not add up, which also gives
+ * the sequential result for corrupt data. */
+static int dec_speculate(jpeg_decoder_t* d, int mb, int mcusx, int mcus,
+                         int threads) {
+    const uint8_t* seg[2];
+    struct dec_worker* w;
+    int64_t len;
+    int i, j, k, t, b, fail = 0;
+    int dc[MAXCOMP];
+    if (dec_intervals(d->reader.p, 0, 1, 1, seg))
+        return 1;
+    len = (int64_t)(seg[1] - seg[0]) * 8;
+    t = (int)(len / (8 * DEC_CHUNK) < threads ? len / (8 * DEC_CHUNK) : threads);
+    if (t < 2)
+        return 1;
+    w = dec_workers(d, t, mb, mcusx, mcus);
+    if (w == NULL)
+        return 1;
+    for (i = 0; i < t; i++) {
+        w[i].base = seg[0];
+        w[i].start = len * i / t / 8 * 8;
+        w[i].end = len * (i + 1) / t / 8 * 8;
+        if (i > 0 && seg[0][(w[i].start >> 3) - 1] == 0xff)
+            w[i].start += 8;    /* not on a stuffed zero */
+        w[i].work = dec_spec_chunk;
+    }
+    for (i = 0; i + 1 < t; i++)
+        w[i].end = w[i + 1].start;
+    dec_run(d, w, t);
+    for (i = 0; i < t; i++) {
+        fail |= w[i].fail;
+        w[i].work = dec_spec_walk;
+    }
+    if (!fail)
+        dec_run(d, w, t);
+    /* chain the regions from the start */
+    memset(dc, 0, sizeof(dc));
+    for (i = 0, j = 0, b = 0; !fail;) {
+        w[i].pos0 = i == 0 ? 0 : w[i].trace[j].pos;
+        memcpy(w[i].dc0, dc, sizeof(dc));
+        w[i].m0 = b;
+        if (w[i].sync < 0) {
+            w[i].m1 = mcus;
+            break;
+        }
+        b += w[i].n - j + w[i].cnt;
+        if (b > mcus)
+            fail = 1;
+        for (k = 0; k < w[i].ns; k++)
+            dc[k] += w[i].dc[k] - (i == 0 ? 0 : w[i].trace[j].dc[k]);
+        w[i].m1 = b;
+        k = w[i].sync;
+        j = w[i].sidx;
+        w[i].next = w[k].trace[j].pos;
+        i = k;
+    }
+    for (i = 0; i < t; i++)
+        w[i].work = dec_spec_region;
+    if (!fail)
+        dec_run(d, w, t);
+    for (i = 0; i < t; i++) {
+        fail |= w[i].fail;
+        free(w[i].trace);
+    }
+    free(w);
+    return fail;
+}
+#endif
+
+static int dec_decode(jpeg_decoder_t* d, uint8_t** pic, int* width,
+                      int* height, const jpeg_decode_options_t* options,
+                      const jpeg_decode_target_t* target) {
     struct jpeg_decdata* decdata;
-    int i, j, m, tac, tdc;
+    jpeg_decode_target_t own;
+    int i, j, m, n, tac, tdc;
     int intwidth, intheight;
-    int mcusx, mcusy, mx, my;
-    int ypitch, xpitch, bpp, pitch, x, y;
+    int mcusx, mcusy;
+    int scale, outwidth, outheight, threads;
     int mb;
-    int max[6];
-    ftopict convert;
     int err = 0;
-    int isInitHuffman = 0;
-    decdata = (struct jpeg_decdata*)malloc(sizeof(struct jpeg_decdata));
-    if (!decdata) {
-        err = -1;
-        goto error;
-    }
-    if (buf == NULL) {
+    decdata = &d->decdata;
+    decdata->dct = options != NULL ? options->dct : jpeg_dct_default;
+    decdata->format = options != NULL ? options->format : jpeg_format_yuyv;
+    scale = options != NULL && options->scale != 0 ? options->scale : 1;
+    threads = options != NULL ? options->threads : 0;
+    if (decdata->dct < jpeg_dct_default || decdata->dct > jpeg_dct_float ||
+        decdata->format < jpeg_format_yuyv ||
+        decdata->format > jpeg_format_gray ||
+        (scale != 1 && scale != 2 && scale != 4 && scale != 8) ||
+        threads < 0) {
         err = -1;
         goto error;
     }
-    datap = buf;
-    if (getbyte() != 0xff) {
+    /* reduced IDCTs take the plain quantizers of jpeg_dct_accurate */
+    if (decdata->dct == jpeg_dct_default || scale > 1)
+        decdata->dct = jpeg_dct_accurate;
+    decdata->bs = 8 / scale;
+    decdata->bsh = scale == 1 ? 3 : scale == 2 ? 2 : scale == 4 ? 1 : 0;
+    if (getbyte(d) != 0xff) {
         err = ERR_NO_SOI;
         goto error;
     }
-    if (getbyte() != M_SOI) {
+    if (getbyte(d) != M_SOI) {
         err = ERR_NO_SOI;
         goto error;
     }
-    if (readtables(M_SOF0, &isInitHuffman)) {
+    for (i = 0; i < 4; i++) {
+        d->dhuff[i] = NULL;
+        if (d->qmask & 1 << i)
+            memcpy(d->quant_table[i], d->qpre[i], 64);
+    }
+    if (readtables(d, M_SOF0)) {
         err = ERR_BAD_TABLES;
         goto error;
     }
-    getword();
-    i = getbyte();
+    getword(d);
+    i = getbyte(d);
     if (i != 8) {
         err = ERR_NOT_8BIT;
         goto error;
     }
-    intheight = getword();
-    intwidth = getword();
-    if ((intheight & 7) || (intwidth & 7)) {
+    intheight = getword(d);
+    intwidth = getword(d);
+    if (intheight == 0 || intwidth == 0) {    /* 0: DNL, not supported */
         err = ERR_BAD_WIDTH_OR_HEIGHT;
         goto error;
     }
-    info.nc = getbyte();
-    if (info.nc > MAXCOMP) {
+    d->info.nc = getbyte(d);
+    if (d->info.nc > MAXCOMP) {
         err = ERR_TOO_MANY_COMPPS;
         goto error;
     }
-    for (i = 0; i < info.nc; i++) {
+    for (i = 0; i < d->info.nc; i++) {
         int h, v;
-        comps[i].cid = getbyte();
-        comps[i].hv = getbyte();
-        v = comps[i].hv & 15;
-        h = comps[i].hv >> 4;
-        comps[i].tq = getbyte();
+        d->comps[i].cid = getbyte(d);
+        d->comps[i].hv = getbyte(d);
+        v = d->comps[i].hv & 15;
+        h = d->comps[i].hv >> 4;
+        d->comps[i].tq = getbyte(d);
         if (h > 3 || v > 3) {
             err = ERR_ILLEGAL_HV;
             goto error;
         }
-        if (comps[i].tq > 3) {
+        if (d->comps[i].tq > 3) {
             err = ERR_QUANT_TABLE_SELECTOR;
             goto error;
         }
     }
-    if (readtables(M_SOS, &isInitHuffman)) {
+    if (readtables(d, M_SOS)) {
         err = ERR_BAD_TABLES;
         goto error;
     }
-    getword();
-    info.ns = getbyte();
-    if (!info.ns) {
-        printf("info ns %d/n", info.ns);
+    huffman_init(d);
+    getword(d);
+    d->info.ns = getbyte(d);
+    if (!d->info.ns) {
         err = ERR_NOT_YCBCR_221111;
         goto error;
     }
-    for (i = 0; i < info.ns; i++) {
-        dscans[i].cid = getbyte();
-        tdc = getbyte();
+    for (i = 0; i < d->info.ns; i++) {
+        d->dscans[i].cid = getbyte(d);
+        tdc = getbyte(d);
         tac = tdc & 15;
         tdc >>= 4;
         if (tdc > 1 || tac > 1) {
             err = ERR_QUANT_TABLE_SELECTOR;
             goto error;
         }
-        for (j = 0; j < info.nc; j++)
-            if (comps[j].cid == dscans[i].cid)
+        for (j = 0; j < d->info.nc; j++)
+            if (d->comps[j].cid == d->dscans[i].cid)
                 break;
-        if (j == info.nc) {
+        if (j == d->info.nc) {
             err = ERR_UNKNOWN_CID_IN_SCAN;
             goto error;
         }
-        dscans[i].hv = comps[j].hv;
-        dscans[i].tq = comps[j].tq;
-        dscans[i].hudc.dhuff = dec_huffdc + tdc;
-        dscans[i].huac.dhuff = dec_huffac + tac;
-    }
-    i = getbyte();
-    j = getbyte();
-    m = getbyte();
-    if (i != 0 || j != 63 || m != 0) {
-        printf("hmm FW error,not seq DCT ??\n");
-    }
-    // printf("ext huffman table %d \n",isInitHuffman);
-    if (!isInitHuffman) {
-        if (huffman_init() < 0)
-            return -ERR_BAD_TABLES;
+        d->dscans[i].hv = d->comps[j].hv;
+        d->dscans[i].tq = d->comps[j].tq;
+        d->dscans[i].hudc.dhuff = d->dhuff[tdc];
+        d->dscans[i].huac.dhuff = d->dhuff[2 + tac];
+    }
+    getbyte(d);    /* Ss, Se, Ah Al: 0, 63, 0 for sequential DCT */
+    getbyte(d);
+    getbyte(d);
+    if (d->reader.eof) {
+        err = ERR_EOF;
+        goto error;
     }
     /*
-        if (dscans[0].cid != 1 || dscans[1].cid != 2 || dscans[2].cid != 3) {
+        if (d->dscans[0].cid != 1 || d->dscans[1].cid != 2 || d->dscans[2].cid != 3) {
         err = ERR_NOT_YCBCR_221111;
         goto error;
         }
 
-        if (dscans[1].hv != 0x11 || dscans[2].hv != 0x11) {
+        if (d->dscans[1].hv != 0x11 || d->dscans[2].hv != 0x11) {
         err = ERR_NOT_YCBCR_221111;
         goto error;
         }
     */
-    /* if internal width and external are not the same or heigth too
-        and pic not allocated realloc the good size and mark the change
-        need 1 macroblock line more ?? */
-    if (intwidth != *width || intheight != *height || *pic == NULL) {
-        *width = intwidth;
-        *height = intheight;
-        // BytesperPixel 2 yuyv , 3 rgb24
-        *pic =
-            (uint8_t*)realloc((uint8_t*)*pic,
-                (size_t)intwidth * (intheight +
-                    8) * 2);
-    }
-    switch (dscans[0].hv) {
-        case 0x22: // 411
+    switch (d->dscans[0].hv) {
+        case 0x22: // 420
             mb = 6;
-            // see https://github.com/TimSC/mjpeg/pull/1/commits/50ae8fb6e84a5953b68651b1d3ff1f3cbd66a356
-    //    mcusx = *width >> 4;
-    //    mcusy = *height >> 4;
-            mcusx = (intwidth % 16 == 0) ? (intwidth / 16) : (intwidth / 16) + 1;
-            mcusy = (intheight % 16 == 0) ? (intheight / 16) : (intheight / 16) + 1;
-            bpp = 2;
-            xpitch = 16 * bpp;
-            pitch = *width * bpp; // YUYV out
-            ypitch = 16 * pitch;
-            convert = yuv420pto422;
             break;
-        case 0x21: //422
-            // printf("find 422 %dx%d\n",*width,*height);
+        case 0x21: // 422
             mb = 4;
-            //    mcusx = *width >> 4;
-            //    mcusy = *height >> 3;
-            mcusx = (intwidth % 16 == 0) ? (intwidth / 16) : (intwidth / 16) + 1;
-            mcusy = (intheight % 16 == 0) ? (intheight / 16) : (intheight / 16) + 1;
-            bpp = 2;
-            xpitch = 16 * bpp;
-            pitch = *width * bpp; // YUYV out
-            ypitch = 8 * pitch;
-            convert = yuv422pto422;
             break;
-        case 0x11: //444
-            //    mcusx = *width >> 3;
-            //    mcusy = *height >> 3;
-            mcusx = (intwidth % 16 == 0) ? (intwidth / 16) : (intwidth / 16) + 1;
-            mcusy = (intheight % 16 == 0) ? (intheight / 16) : (intheight / 16) + 1;
-
-            bpp = 2;
-            xpitch = 8 * bpp;
-            pitch = *width * bpp; // YUYV out
-            ypitch = 8 * pitch;
-            if (info.ns == 1) {
-                mb = 1;
-                convert = yuv400pto422;
-            } else {
-                mb = 3;
-                convert = yuv444pto422;
-            }
+        case 0x11: // 444
+            mb = d->info.ns == 1 ? 1 : 3;
             break;
         default:
             err = ERR_NOT_YCBCR_221111;
             goto error;
             break;
     }
-    idctqtab(quant_table[dscans[0].tq], decdata->dquant[0]);
-    idctqtab(quant_table[dscans[1].tq], decdata->dquant[1]);
-    idctqtab(quant_table[dscans[2].tq], decdata->dquant[2]);
-    setinput(&input, datap);
-    dec_initscans();
-
-    dscans[0].next = 2;
-    dscans[1].next = 1;
-    dscans[2].next = 0;    /* 4xx encoding */
-    for (my = 0, y = 0; my < mcusy; my++, y += ypitch) {
-        for (mx = 0, x = 0; mx < mcusx; mx++, x += xpitch) {
-            if (info.dri && !--info.nm)
-                if (dec_checkmarker()) {
-                    err = ERR_WRONG_MARKER;
-                    goto error;
-                }
-            switch (mb) {
-            case 6: {
-                decode_mcus(&input, decdata->dcts, mb, dscans, max);
-                idct(decdata->dcts, decdata->out, decdata->dquant[0],
-                    IFIX(128.5), max[0]);
-                idct(decdata->dcts + 64, decdata->out + 64,
-                    decdata->dquant[0], IFIX(128.5), max[1]);
-                idct(decdata->dcts + 128, decdata->out + 128,
-                    decdata->dquant[0], IFIX(128.5), max[2]);
-                idct(decdata->dcts + 192, decdata->out + 192,
-                    decdata->dquant[0], IFIX(128.5), max[3]);
-                idct(decdata->dcts + 256, decdata->out + 256,
-                    decdata->dquant[1], IFIX(0.5), max[4]);
-                idct(decdata->dcts + 320, decdata->out + 320,
-                    decdata->dquant[2], IFIX(0.5), max[5]);
-
-            } break;
-            case 4:
-            {
-                decode_mcus(&input, decdata->dcts, mb, dscans, max);
-                idct(decdata->dcts, decdata->out, decdata->dquant[0],
-                    IFIX(128.5), max[0]);
-                idct(decdata->dcts + 64, decdata->out + 64,
-                    decdata->dquant[0], IFIX(128.5), max[1]);
-                idct(decdata->dcts + 128, decdata->out + 256,
-                    decdata->dquant[1], IFIX(0.5), max[4]);
-                idct(decdata->dcts + 192, decdata->out + 320,
-                    decdata->dquant[2], IFIX(0.5), max[5]);
-
-            }
-            break;
-            case 3:
-                decode_mcus(&input, decdata->dcts, mb, dscans, max);
-                idct(decdata->dcts, decdata->out, decdata->dquant[0],
-                    IFIX(128.5), max[0]);
-                idct(decdata->dcts + 64, decdata->out + 256,
-                    decdata->dquant[1], IFIX(0.5), max[4]);
-                idct(decdata->dcts + 128, decdata->out + 320,
-                    decdata->dquant[2], IFIX(0.5), max[5]);
-
-
-                break;
-            case 1:
-                decode_mcus(&input, decdata->dcts, mb, dscans, max);
-                idct(decdata->dcts, decdata->out, decdata->dquant[0],
-                    IFIX(128.5), max[0]);
-
-                break;
-
-            } // switch enc411
-            convert(decdata->out, *pic + y + x, pitch);
+    decdata->hs = d->dscans[0].hv >> 4;
+    decdata->vs = d->dscans[0].hv & 15;
+    /* scaled 4:2:0 chroma at twice the luma IDCT size lands at output
+     * resolution as in libjpeg, other chroma is replicated */
+    decdata->cbs = decdata->bs;
+    decdata->chs = decdata->hs - 1;
+    decdata->cvs = decdata->vs - 1;
+    if (decdata->hs == 2 && decdata->vs == 2 && decdata->bs < 8) {
+        decdata->cbs = decdata->bs * 2;
+        decdata->chs = decdata->cvs = 0;
+    }
+    decdata->chroma = mb != 1 && decdata->format != jpeg_format_gray;
+    mcusx = (intwidth + 8 * decdata->hs - 1) / (8 * decdata->hs);
+    mcusy = (intheight + 8 * decdata->vs - 1) / (8 * decdata->vs);
+    outwidth = (intwidth + scale - 1) / scale;
+    outheight = (intheight + scale - 1) / scale;
+    decdata->pw = outwidth;
+    decdata->ph = outheight;
+    if (dec_window(decdata, options, &outwidth, &outheight)) {
+        err = -1;
+        goto error;
+    }
+    /* if internal width and external are not the same or heigth too
+        and pic not allocated realloc the good size and mark the change */
+    if (target == NULL &&
+        (outwidth != *width || outheight != *height || *pic == NULL)) {
+        *pic = (uint8_t*)realloc((uint8_t*)*pic,
+            dec_size(decdata->format, outwidth, outheight));
+        if (*pic == NULL) {
+            err = -1;
+            goto error;
+        }
+    }
+    if (target == NULL) {
+        dec_planes(&own, decdata->format, *pic, outwidth, outheight);
+        target = &own;
+    }
+    *width = outwidth;
+    *height = outheight;
+    decdata->width = outwidth;
+    decdata->height = outheight;
+    if (dec_target(decdata, target)) {
+        err = -1;
+        goto error;
+    }
+    dec_qtab(d, d->quant_table[d->dscans[0].tq], 0);
+    dec_qtab(d, d->quant_table[d->dscans[1].tq], 1);
+    dec_qtab(d, d->quant_table[d->dscans[2].tq], 2);
+    if (d->reader.read == NULL)
+        d->reader.end = dec_scanend(d->reader.p);
+    setinput(&d->input, &d->reader);
+    dec_initscans(d);
+
+    d->dscans[0].next = 2;
+    d->dscans[1].next = 1;
+    d->dscans[2].next = 0;    /* 4xx encoding */
+    m = mcusx * mcusy;
+#ifdef DEC_THREADS
+    if (d->info.dri > 0 && threads > 1 && d->reader.read == NULL)
+        return dec_parallel(d, mb, mcusx, m, threads);
+    if (threads > 1 && d->reader.read == NULL &&
+        !dec_speculate(d, mb, mcusx, m, threads))
+        return 0;
+#endif
+    n = d->info.dri > 0 ? d->info.dri : m;
+    for (i = 0; i < m; i += n) {
+        if (i > 0 && dec_checkmarker(d)) {
+            err = ERR_WRONG_MARKER;
+            goto error;
         }
+        if (dec_interval(decdata, &d->input, d->dscans, mb, mcusx, i,
+                i + n < m ? i + n : m))
+            return 0;    /* below the crop window */
     }
 
-    m = dec_readmarker(&input);
+    m = dec_readmarker(&d->input);
     if (m != M_EOI) {
-        err = ERR_NO_EOI;
+        err = m == M_EOF ? ERR_EOF : ERR_NO_EOI;
         goto error;
     }
-    if (decdata)
-        free(decdata);
     return 0;
 error:
-    if (decdata)
-        free(decdata);
     return err;
 }
 
 /****************************************************************/
 /**************       huffman decoder             ***************/
 /****************************************************************/
-static int huffman_init(void)
+/* Slots the image left undefined take the preloaded tables, else the
+ * standard ones (MJPEG frames carry no DHT) */
+static void huffman_init(jpeg_decoder_t* d)
 {
-    int tc, th, tt;
     const uint8_t* ptr = JPEGHuffmanTable;
-    int i, j, l;
-    l = JPG_HUFFMAN_TABLE_LENGTH;
-    while (l > 0) {
-        int hufflen[16], k;
-        uint8_t huffvals[256];
-
-        tc = *ptr++;
-        th = tc & 15;
-        tc >>= 4;
-        tt = tc * 2 + th;
-        if (tc > 1 || th > 1)
-            return -ERR_BAD_TABLES;
+    int i, l, n, tt;
+    for (l = JPG_HUFFMAN_TABLE_LENGTH; l > 0; ptr += n, l -= n) {
+        tt = (ptr[0] >> 4) * 2 + (ptr[0] & 15);
+        n = 1 + 16;
         for (i = 0; i < 16; i++)
-            hufflen[i] = *ptr++;
-        l -= 1 + 16;
-        k = 0;
-        for (i = 0; i < 16; i++) {
-            for (j = 0; j < hufflen[i]; j++)
-                huffvals[k++] = *ptr++;
-            l -= hufflen[i];
-        }
-        dec_makehuff(dhuff + tt, hufflen, huffvals);
+            n += ptr[1 + i];
+        if (d->dhuff[tt] == NULL)
+            d->dhuff[tt] = d->hpre[tt] != NULL ? d->hpre[tt] :
+                dec_huff(d, ptr, n);
     }
-    return 0;
 }
 
-static int fillbits(in_t*, int, uint32_t);
-static int dec_rec2(in_t*, struct dec_hufftbl*, int*, int, int);
+static int dec_rec2(in_t*, struct dec_hufftbl*, int*, int);
 
-static void setinput(in_t* in, uint8_t* p) {
-    in->p = p;
+static void setinput(in_t* in, jpeg_reader_t* r) {
+    in->reader = r;
     in->left = 0;
     in->bits = 0;
     in->marker = 0;
 }
 
-static int fillbits(in_t* in, int le, uint32_t bi) {
-    int b, m;
+/* 8 bytes big endian */
+static uint64_t dec_load64(const uint8_t* p) {
+    uint64_t w;
+    memcpy(&w, p, 8);
+#if defined(_MSC_VER) && !defined(__clang__)
+    return _byteswap_uint64(w);
+#elif defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    return w;
+#elif defined(__GNUC__)
+    return __builtin_bswap64(w);
+#else
+    return (uint64_t)p[0] << 56 | (uint64_t)p[1] << 48 |
+        (uint64_t)p[2] << 40 | (uint64_t)p[3] << 32 | (uint64_t)p[4] << 24 |
+        (uint64_t)p[5] << 16 | (uint64_t)p[6] << 8 | p[7];
+#endif
+}
+
+/* Tops the register up to more than 56 bits. Eight bytes free of 0xff hold
+ * neither stuffing nor markers and are taken whole, whatever of them fits;
+ * otherwise bytes are taken one by one. The reader's buffer refills as it
+ * drains, end of input reads as M_EOF. */
+static int fillbits(in_t* in, int le, uint64_t bi) {
+    jpeg_reader_t* r = in->reader;
+    uint64_t w;
+    int b, m, k;
     if (in->marker) {
         if (le <= 16)
             in->bits = bi << 16, le += 16;
         return le;
     }
-    while (le <= 24) {
-        b = *in->p++;
-        if (b == 0xff && (m = *in->p++) != 0) {
-            if (m == M_EOF) {
-                if (in->func && (m = in->func(in->data)) == 0)
-                    continue;
-            }
-            in->marker = m;
+    if (le <= 56 && r->end - r->p >= 8) {
+        w = dec_load64(r->p);
+        if (!((~w - 0x0101010101010101ull) & w & 0x8080808080808080ull)) {
+            k = (64 - le) >> 3;
+            in->bits = bi << 1 << (8 * k - 1) | w >> (64 - 8 * k);
+            r->p += k;
+            return le + 8 * k;
+        }
+    }
+    while (le <= 56) {
+        b = READBYTE(r);
+        if (b < 0 || (b == 0xff && (m = READBYTE(r)) != 0)) {
+            in->marker = b < 0 || m < 0 ? M_EOF : m;
             if (le <= 16)
                 bi = bi << 16, le += 16;
             break;
@@ -800,7 +1722,7 @@ static int dec_readmarker(in_t* in) {
     return m;
 }
 
-#define LEBI_DCL    int le, bi
+#define LEBI_DCL    int le; uint64_t bi
 #define LEBI_GET(in)    (le = in->left, bi = in->bits)
 #define LEBI_PUT(in)    (in->left = le, in->bits = bi)
 
@@ -814,7 +1736,11 @@ bi >> le & ((1 << (n)) - 1)                    \
 le += (n)            \
 )
 
-static int dec_rec2(in_t* in, struct dec_hufftbl* hu, int* runp, int c, int i) {
+/* The symbol of llvals entry i that did not resolve within DECBITS bits:
+ * its value bits are still to be read or, for i == 0, the code is longer
+ * and resolves in the second level. */
+static int dec_rec2(in_t* in, struct dec_hufftbl* hu, int* runp, int i) {
+    int c;
     LEBI_DCL;
 
     LEBI_GET(in);
@@ -823,13 +1749,14 @@ static int dec_rec2(in_t* in, struct dec_hufftbl* hu, int* runp, int c, int i) {
         *runp = i >> 8 & 15;
         i >>= 16;
     } else {
-        for (i = DECBITS;
-            (c = ((c << 1) | GETBITS(in, 1))) >= (hu->maxcode[i]); i++);
-        if (i >= 16) {
+        UNGETBITS(in, DECBITS);
+        c = (int)GETBITS(in, 16) - hu->longbase;
+        if (c < 0 || c >= hu->nlong || hu->longvals[c] == 0) {
             in->marker = M_BADHUFF;
             return 0;
         }
-        i = hu->vals[hu->valptr[i] + c - hu->maxcode[i - 1] * 2];
+        UNGETBITS(in, 16 - (hu->longvals[c] >> 8));
+        i = hu->longvals[c] & 255;
         *runp = i >> 4;
         i &= 15;
     }
@@ -847,7 +1774,7 @@ static int dec_rec2(in_t* in, struct dec_hufftbl* hu, int* runp, int c, int i) {
 
 #define DEC_REC(in, hu, r, i)     (    \
     r = GETBITS(in, DECBITS),        \
-    i = hu->llvals[r],            \
+    i = (int)(uint32_t)hu->llvals[r],    \
     i & 128 ?                \
         (                    \
         UNGETBITS(in, i & 127),        \
@@ -857,84 +1784,153 @@ static int dec_rec2(in_t* in, struct dec_hufftbl* hu, int* runp, int c, int i) {
         :                    \
         (                    \
             LEBI_PUT(in),            \
-            i = dec_rec2(in, hu, &r, r, i),    \
+            i = dec_rec2(in, hu, &r, i),    \
             LEBI_GET(in),            \
             i                    \
         )                    \
     )
 
-static void decode_mcus(in_t* in, int* dct, int n, struct scan* sc, int* maxp) {
+/* natural order position of zigzag index, 16 extra entries catch run
+ * lengths past the end of corrupt blocks */
+static const uint8_t unzig[64 + 16] = {
+    0, 1, 8, 16, 9, 2, 3, 10,
+    17, 24, 32, 25, 18, 11, 4, 5,
+    12, 19, 26, 33, 40, 48, 41, 34,
+    27, 20, 13, 6, 7, 14, 21, 28,
+    35, 42, 49, 56, 57, 50, 43, 36,
+    29, 22, 15, 23, 30, 37, 44, 51,
+    58, 59, 52, 45, 38, 31, 39, 46,
+    53, 60, 61, 54, 47, 55, 62, 63,
+    63, 63, 63, 63, 63, 63, 63, 63,
+    63, 63, 63, 63, 63, 63, 63, 63
+};
+
+/* n blocks of coefficients in natural order, maxp[] gets the zigzag index
+ * past the last decoded coefficient of each. AC symbol pairs resolved by a
+ * single llvals entry are taken at once unless the first ends the block. */
+static void decode_mcus(in_t* in, int16_t* dct, int n, struct scan* sc,
+                        int* maxp) {
     struct dec_hufftbl* hu;
-    int i, r, t;
+    uint64_t e;
+    int k, r, t, p, v;
     LEBI_DCL;
 
     memset(dct, 0, n * 64 * sizeof(*dct));
     LEBI_GET(in);
     while (n-- > 0) {
         hu = sc->hudc.dhuff;
-        *dct++ = (sc->dc += DEC_REC(in, hu, r, t));
+        dct[0] = (int16_t)(sc->dc += DEC_REC(in, hu, r, t));
 
         hu = sc->huac.dhuff;
-        i = 63;
-        while (i > 0) {
-            t = DEC_REC(in, hu, r, t);
-            if (t == 0 && r == 0) {
-                dct += i;
-                break;
+        k = 1;
+        while (k < 64) {
+            e = hu->llvals[GETBITS(in, DECBITS)];
+            t = (int)(uint32_t)e;
+            /* without branches, pairs are not predictable */
+            r = k + (t >> 8 & 15);
+            p = (int)(e >> 39 & 1) & (r < 63);
+            v = dct[unzig[r]];
+            dct[unzig[r]] = (int16_t)(p ? t >> 16 : v);
+            k = p ? r + 1 : k;
+            t = p ? (int)(uint32_t)(e >> 32) : t;
+            if (t & 128) {
+                UNGETBITS(in, t & 127);
+                r = t >> 8 & 15;
+                t >>= 16;
+            } else {
+                LEBI_PUT(in);
+                t = dec_rec2(in, hu, &r, t);
+                LEBI_GET(in);
             }
-            dct += r;
-            *dct++ = t;
-            i -= r + 1;
+            if (t == 0 && r == 0)
+                break;
+            k += r;
+            dct[unzig[k]] = (int16_t)t;
+            k++;
         }
-        *maxp++ = 64 - i;
+        *maxp++ = k > 64 ? 64 : k;
+        dct += 64;
         if (n == sc->next)
             sc++;
     }
     LEBI_PUT(in);
 }
 
-static void dec_makehuff(struct dec_hufftbl* hu, int* hufflen, uint8_t* huffvals) {
-    int code, k, i, j, d, x, c, v;
+static void dec_makehuff(struct dec_hufftbl* hu, int* hufflen, uint8_t* huffvals,
+                         int ac) {
+    int code, k, i, j, d, x, c, v, u;
+    uint32_t y;
     for (i = 0; i < (1 << DECBITS); i++)
         hu->llvals[i] = 0;
+    memset(hu->longvals, 0, sizeof(hu->longvals));
+    hu->longbase = -1;
+    hu->nlong = 0;
     /*
-        * llvals layout:
+        * llvals layout, low 32 bits:
         *
         * value v already known, run r, backup u bits:
         *  vvvvvvvvvvvvvvvv 0000 rrrr 1 uuuuuuu
         * value unknown, size b bits, run r, backup u bits:
         *  000000000000bbbb 0000 rrrr 0 uuuuuuu
-        * value and size unknown:
+        * value and size unknown (longer code):
         *  0000000000000000 0000 0000 0 0000000
+        *
+        * high 32 bits, AC tables: the symbol following a known value one
+        * in its backup bits, laid out alike with the backup after both
         */
     code = 0;
     k = 0;
     for (i = 0; i < 16; i++, code <<= 1) {    /* sizes */
-        hu->valptr[i] = k;
-        for (j = 0; j < hufflen[i]; j++) {
-            hu->vals[k] = *huffvals++;
+        for (j = 0; j < hufflen[i] && k < 256; j++) {
+            v = huffvals[k] & 0x0f;    /* size */
             if (i < DECBITS) {
                 c = code << (DECBITS - 1 - i);
-                v = hu->vals[k] & 0x0f;    /* size */
                 for (d = 1 << (DECBITS - 1 - i); --d >= 0;) {
                     if (v + i < DECBITS) {    /* both fit in table */
                         x = d >> (DECBITS - 1 - v - i);
                         if (v && x < (1 << (v - 1)))
                             x += (-1 << v) + 1;
-                        x = x << 16 | (hu->vals[k] & 0xf0) << 4 |
+                        x = x << 16 | (huffvals[k] & 0xf0) << 4 |
                             (DECBITS - (i + 1 + v)) | 128;
                     } else
-                        x = v << 16 | (hu->vals[k] & 0xf0) << 4 |
+                        x = v << 16 | (huffvals[k] & 0xf0) << 4 |
                         (DECBITS - (i + 1));
-                    hu->llvals[c | d] = x;
+                    if ((c | d) < (1 << DECBITS))
+                        hu->llvals[c | d] = (uint32_t)x;
                 }
+            } else {    /* second level */
+                c = code << (15 - i);
+                if (hu->longbase < 0)
+                    hu->longbase = c;
+                c -= hu->longbase;
+                for (d = 1 << (15 - i); --d >= 0;)
+                    if (c + d < (int)(sizeof(hu->longvals) /
+                            sizeof(hu->longvals[0])))
+                        hu->longvals[c + d] = (uint16_t)((i + 1) << 8 |
+                            huffvals[k]);
+                hu->nlong = c + (1 << (15 - i));
             }
             code++;
             k++;
         }
-        hu->maxcode[i] = code;
     }
-    hu->maxcode[16] = 0x20000;    /* always terminate decode */
+    if (hu->nlong > (int)(sizeof(hu->longvals) / sizeof(hu->longvals[0])))
+        hu->nlong = (int)(sizeof(hu->longvals) / sizeof(hu->longvals[0]));
+    if (!ac)
+        return;
+    /* pairs: the backup bits of a known value symbol other than EOB looked
+     * up again, zero filled, resolve a known value symbol within them */
+    for (i = 0; i < (1 << DECBITS); i++) {
+        y = (uint32_t)hu->llvals[i];
+        u = y & 127;
+        if (!(y & 128) || u == 0 || (y & 0xffff0f00) == 0)
+            continue;
+        y = (uint32_t)hu->llvals[(i & ((1 << u) - 1)) << (DECBITS - u)];
+        if (!(y & 128) || DECBITS - (int)(y & 127) > u)
+            continue;
+        y = (y & ~127u) | (u - (DECBITS - (y & 127)));
+        hu->llvals[i] |= (uint64_t)y << 32;
+    }
 }
 
 /****************************************************************/
@@ -949,29 +1945,30 @@ static void dec_makehuff(struct dec_hufftbl* hu, int* hufflen, uint8_t* huffvals
 #define C22 ((PREC)IFIX(2 * 0.923879532))
 #define IC4 ((PREC)IFIX(1 / 0.707106781))
 
-static uint8_t zig2[64] = {
-    0, 2, 3, 9, 10, 20, 21, 35,
-    14, 16, 25, 31, 39, 46, 50, 57,
-    5, 7, 12, 18, 23, 33, 37, 48,
-    27, 29, 41, 44, 52, 55, 59, 62,
-    15, 26, 30, 40, 45, 51, 56, 58,
-    1, 4, 8, 11, 19, 22, 34, 36,
-    28, 42, 43, 53, 54, 60, 61, 63,
-    6, 13, 17, 24, 32, 38, 47, 49
+/* natural order positions of the column inputs t0 t5 t2 t7 t1 t4 t3 t6 */
+static const uint8_t zig2[64] = {
+    0, 8, 16, 24, 32, 40, 48, 56,
+    4, 12, 20, 28, 36, 44, 52, 60,
+    2, 10, 18, 26, 34, 42, 50, 58,
+    6, 14, 22, 30, 38, 46, 54, 62,
+    5, 13, 21, 29, 37, 45, 53, 61,
+    1, 9, 17, 25, 33, 41, 49, 57,
+    7, 15, 23, 31, 39, 47, 55, 63,
+    3, 11, 19, 27, 35, 43, 51, 59
 };
 
-inline static void idct(int* in, int* out, int* quant, long off, int max) {
+inline static void idct(const int16_t* in, uint8_t* out, const int* quant,
+                        int max) {
     long t0, t1, t2, t3, t4, t5, t6, t7;    // t ;
     long tmp0, tmp1, tmp2, tmp3, tmp4, tmp5, tmp6;
     long tmp[64], * tmpp;
     int i, j, te;
-    uint8_t* zig2p;
+    const uint8_t* zig2p;
 
-    t0 = off;
+    t0 = IFIX(128.5);
     if (max == 1) {
         t0 += in[0] * quant[0];
-        for (i = 0; i < 64; i++)
-            out[i] = ITOINT(t0);
+        memset(out, clip(ITOINT(t0)), 64);
         return;
     }
     zig2p = zig2;
@@ -1056,14 +2053,7 @@ inline static void idct(int* in, int* out, int* quant, long off, int max) {
         t7 = tmp[j + 7];
         if ((t1 | t2 | t3 | t4 | t5 | t6 | t7) == 0) {
             te = ITOINT(t0);
-            out[j + 0] = te;
-            out[j + 1] = te;
-            out[j + 2] = te;
-            out[j + 3] = te;
-            out[j + 4] = te;
-            out[j + 5] = te;
-            out[j + 6] = te;
-            out[j + 7] = te;
+            memset(out + j, clip(te), 8);
             j += 8;
             continue;
         }
@@ -1091,20 +2081,20 @@ inline static void idct(int* in, int* out, int* quant, long off, int max) {
         t5 = tmp5 - t6;
         t4 = tmp4 - t5;
 
-        out[j + 0] = ITOINT(tmp3 + t7);
-        out[j + 1] = ITOINT(tmp1 + t6);
-        out[j + 2] = ITOINT(tmp2 + t5);
-        out[j + 3] = ITOINT(t3 + t4);
-        out[j + 4] = ITOINT(t3 - t4);
-        out[j + 5] = ITOINT(tmp2 - t5);
-        out[j + 6] = ITOINT(tmp1 - t6);
-        out[j + 7] = ITOINT(tmp3 - t7);
+        out[j + 0] = clip(ITOINT(tmp3 + t7));
+        out[j + 1] = clip(ITOINT(tmp1 + t6));
+        out[j + 2] = clip(ITOINT(tmp2 + t5));
+        out[j + 3] = clip(ITOINT(t3 + t4));
+        out[j + 4] = clip(ITOINT(t3 - t4));
+        out[j + 5] = clip(ITOINT(tmp2 - t5));
+        out[j + 6] = clip(ITOINT(tmp1 - t6));
+        out[j + 7] = clip(ITOINT(tmp3 - t7));
         j += 8;
     }
 
 }
 
-static uint8_t zig[64] = {
+static const uint8_t zig[64] = {
     0, 1, 5, 6, 14, 15, 27, 28,
     2, 4, 7, 13, 16, 26, 29, 42,
     3, 8, 12, 17, 25, 30, 41, 43,
@@ -1115,181 +2105,1024 @@ static uint8_t zig[64] = {
     35, 36, 48, 49, 57, 58, 62, 63
 };
 
-static PREC aaidct[8] = {
+static const PREC aaidct[8] = {
     IFIX(0.3535533906), IFIX(0.4903926402),
     IFIX(0.4619397663), IFIX(0.4157348062),
     IFIX(0.3535533906), IFIX(0.2777851165),
     IFIX(0.1913417162), IFIX(0.0975451610)
 };
 
-static void idctqtab(uint8_t* qin, PREC* qout) {
+static void idctqtab(const uint8_t* qin, PREC* qout) {
     int i, j;
     for (i = 0; i < 8; i++)
         for (j = 0; j < 8; j++)
-            qout[zig[i * 8 + j]] = qin[zig[i * 8 + j]] *
+            qout[i * 8 + j] = qin[zig[i * 8 + j]] *
             IMULT(aaidct[i], aaidct[j]);
 }
 
-#define  FOUR_TWO_TWO 2        // Y00 Cb Y01 Cr
+/* accurate integer IDCT: LLM with 13 bit constants (libjpeg jidctint.c),
+ * quant holds plain quantizers. Dequantized coefficients are truncated and
+ * the workspace between passes saturated to 16 bit the way the SSE2 and
+ * AVX2 kernels do it, all three produce the same bytes for any input. */
 
-static void yuv444pto422(int * out,unsigned char *pic,int width)
-{
-    int j, k;
-    unsigned char *pic0, *pic1;
-    int *outy, *outu, *outv;
-    int outy1 = 0;
-    int outy2 = 8;
-    int outu1 = 0;
-    int outv1 = 0;
-
-    pic0 = pic;
-    pic1 = pic + width;
-    outy = out;
-    outu = out + 64 * 4; // Ooops where did i invert ??
-    outv = out + 64 * 5;
-    for (j = 0; j < 4; j++) {
-        for (k = 0; k < 4; k++) {
-
-        *pic0++ =clip( outy[outy1]);
-        *pic0++ =clip( 128 + outu[outu1]);
-        *pic0++ =clip( outy[outy1+1]);
-        *pic0++ =clip( 128 + outv[outv1]);
-        *pic1++ =clip( outy[outy2]);
-        *pic1++ =clip( 128 + outu[outu1+8]);
-        *pic1++ =clip( outy[outy2+1]);
-        *pic1++ =clip( 128 + outv[outv1+8]);
-        outv1 += 2; outu1 += 2;
-        outy1 +=2; outy2 +=2;
-      }
-        outy += 16;outu +=16; outv +=16;
-        outv1 = 0; outu1=0;
-        outy1 = 0;
-        outy2 = 8;
-        pic0 += 2 * (width -8);
-        pic1 += 2 * (width -8);
-    }
-
-}
-static void yuv400pto422(int * out,unsigned char *pic,int width)
-{
-    int j, k;
-    unsigned char *pic0, *pic1;
-    int *outy ;
-    int outy1 = 0;
-    int outy2 = 8;
-    pic0 = pic;
-    pic1 = pic + width;
-    outy = out;
-
-    for (j = 0; j < 4; j++) {
-        for (k = 0; k < 4; k++) {
-        *pic0++ = clip(outy[outy1]);
-        *pic0++ = 128 ;
-        *pic0++ = clip(outy[outy1+1]);
-        *pic0++ = 128 ;
-        *pic1++ = clip(outy[outy2]);
-        *pic1++ = 128 ;
-        *pic1++ = clip(outy[outy2+1]);
-        *pic1++ = 128 ;
-         outy1 +=2; outy2 +=2;
-      }
-        outy += 16;
-        outy1 = 0;
-        outy2 = 8;
-        pic0 += 2 * (width -8);
-        pic1 += 2 * (width -8);
-    }
-
-}
-
-static void yuv422pto422(int * out,unsigned char *pic,int width)
-{
-    int j, k;
-    unsigned char *pic0, *pic1;
-    int *outy, *outu, *outv;
-    int outy1 = 0;
-    int outy2 = 8;
-    int outu1 = 0;
-    int outv1 = 0;
-
-
-    pic0 = pic;
-    pic1 = pic + width;
-    outy = out;
-    outu = out + 64 * 4;
-    outv = out + 64 * 5;
-    for (j = 0; j < 4; j++) {
-        for (k = 0; k < 8; k++) {
-        if( k == 4) {
-            outy1 += 56;
-            outy2 += 56;
+#define CONST_BITS 13
+#define PASS1_BITS 2
+#define DESCALE(x, n) (((x) + (1 << ((n) - 1))) >> (n))
+
+static int16_t idct_sat16(int32_t x) {
+    return (int16_t)(x < -32768 ? -32768 : x > 32767 ? 32767 : x);
+}
+
+#ifndef DEC_SSE2
+
+/* 1-D IDCT of c[0], c[s] .. c[7 * s] scaled up by CONST_BITS into r[] */
+static void idct_llm(const int16_t* c, int s, int32_t* r) {
+    int32_t tmp0, tmp1, tmp2, tmp3, tmp10, tmp11, tmp12, tmp13;
+    int32_t z1, z2, z3, z4, z5;
+    z1 = (c[2 * s] + c[6 * s]) * 4433;              /* 0.541196100 */
+    tmp2 = z1 - c[6 * s] * 15137;                   /* 1.847759065 */
+    tmp3 = z1 + c[2 * s] * 6270;                    /* 0.765366865 */
+    tmp0 = (c[0] + c[4 * s]) * (1 << CONST_BITS);
+    tmp1 = (c[0] - c[4 * s]) * (1 << CONST_BITS);
+    tmp10 = tmp0 + tmp3;
+    tmp13 = tmp0 - tmp3;
+    tmp11 = tmp1 + tmp2;
+    tmp12 = tmp1 - tmp2;
+    z1 = c[7 * s] + c[s];
+    z2 = c[5 * s] + c[3 * s];
+    z3 = c[7 * s] + c[3 * s];
+    z4 = c[5 * s] + c[s];
+    z5 = (z3 + z4) * 9633;                          /* 1.175875602 */
+    tmp0 = c[7 * s] * 2446;                         /* 0.298631336 */
+    tmp1 = c[5 * s] * 16819;                        /* 2.053119869 */
+    tmp2 = c[3 * s] * 25172;                        /* 3.072711026 */
+    tmp3 = c[s] * 12299;                            /* 1.501321110 */
+    z1 *= -7373;                                    /* 0.899976223 */
+    z2 *= -20995;                                   /* 2.562915447 */
+    z3 = z3 * -16069 + z5;                          /* 1.961570560 */
+    z4 = z4 * -3196 + z5;                           /* 0.390180644 */
+    tmp0 += z1 + z3;
+    tmp1 += z2 + z4;
+    tmp2 += z2 + z3;
+    tmp3 += z1 + z4;
+    r[0] = tmp10 + tmp3;
+    r[7] = tmp10 - tmp3;
+    r[1] = tmp11 + tmp2;
+    r[6] = tmp11 - tmp2;
+    r[2] = tmp12 + tmp1;
+    r[5] = tmp12 - tmp1;
+    r[3] = tmp13 + tmp0;
+    r[4] = tmp13 - tmp0;
+}
+
+static void idct_accurate(const int16_t* in, uint8_t* out,
+                          const int16_t* quant, int n) {
+    int16_t c[64], ws[64];
+    int32_t r[8];
+    int i, j, te;
+    for (i = 0; i < 64; i++)
+        c[i] = (int16_t)(in[i] * quant[i]);
+    for (i = 0; i < 8; i++) {    /* columns */
+        if (i >= n) {
+            for (j = 0; j < 8; j++)
+                ws[j * 8 + i] = 0;
+            continue;
+        }
+        if ((c[8 + i] | c[16 + i] | c[24 + i] | c[32 + i] | c[40 + i] |
+             c[48 + i] | c[56 + i]) == 0) {
+            te = idct_sat16(c[i] * (1 << PASS1_BITS));
+            for (j = 0; j < 8; j++)
+                ws[j * 8 + i] = (int16_t)te;
+            continue;
         }
-        *pic0++ = clip(outy[outy1]);
-        *pic0++ = clip(128 + outu[outu1]);
-        *pic0++ = clip(outy[outy1+1]);
-        *pic0++ = clip(128 + outv[outv1]);
-        *pic1++ = clip(outy[outy2]);
-        *pic1++ = clip(128 + outu[outu1+8]);
-        *pic1++ = clip(outy[outy2+1]);
-        *pic1++ = clip(128 + outv[outv1+8]);
-        outv1 += 1; outu1 += 1;
-        outy1 +=2; outy2 +=2;
+        idct_llm(c + i, 8, r);
+        for (j = 0; j < 8; j++)
+            ws[j * 8 + i] = idct_sat16(DESCALE(r[j], CONST_BITS - PASS1_BITS));
+    }
+    for (i = 0; i < 64; i += 8) {    /* rows */
+        const int16_t* w = ws + i;
+        if ((w[1] | w[2] | w[3] | w[4] | w[5] | w[6] | w[7]) == 0) {
+            te = DESCALE(w[0], PASS1_BITS + 3) + 128;
+            memset(out + i, clip(te), 8);
+            continue;
+        }
+        idct_llm(w, 1, r);
+        for (j = 0; j < 8; j++) {
+            te = DESCALE(r[j], CONST_BITS + PASS1_BITS + 3) + 128;
+            out[i + j] = clip(te);
+        }
+    }
+}
+
+#else
+
+/* The SSE2 and AVX2 kernels run the same LLM IDCT as idct_llm() on eight
+ * columns (then rows) at once. Every product is a pmaddwd of a pair of 16
+ * bit inputs with a pair of constants (the odd part expanded into four
+ * constants per output), sums stay exact in 32 bit. Blocks with nonzero
+ * coefficients in the top left n x n only multiply rows below n. */
+
+#define IDCT_K(a, b) _mm_setr_epi16(a, b, a, b, a, b, a, b)
+
+/* 32 bit outputs r[0..7] of four lanes from the (c0, c4), (c2, c6),
+ * (c1, c3) and (c5, c7) pairs a, b, c and d. n = 4 leaves out d, n = 2
+ * b too. */
+static DEC_INLINE void idct_sse2_half(__m128i a, __m128i b, __m128i c,
+                                      __m128i d, __m128i rnd, int n,
+                                      __m128i* r) {
+    __m128i e0, e1, x, y, t10, t11, t12, t13, o0, o1, o2, o3;
+    e0 = _mm_add_epi32(_mm_madd_epi16(a, IDCT_K(8192, 8192)), rnd);
+    e1 = _mm_add_epi32(_mm_madd_epi16(a, IDCT_K(8192, -8192)), rnd);
+    x = y = _mm_setzero_si128();
+    if (n > 2) {
+        x = _mm_madd_epi16(b, IDCT_K(10703, 4433));
+        y = _mm_madd_epi16(b, IDCT_K(4433, -10704));
+    }
+    t10 = _mm_add_epi32(e0, x);
+    t13 = _mm_sub_epi32(e0, x);
+    t11 = _mm_add_epi32(e1, y);
+    t12 = _mm_sub_epi32(e1, y);
+    o3 = _mm_madd_epi16(c, IDCT_K(11363, 9633));
+    o2 = _mm_madd_epi16(c, IDCT_K(9633, -2259));
+    o1 = _mm_madd_epi16(c, IDCT_K(6437, -11362));
+    o0 = _mm_madd_epi16(c, IDCT_K(2260, -6436));
+    if (n > 4) {
+        o3 = _mm_add_epi32(o3, _mm_madd_epi16(d, IDCT_K(6437, 2260)));
+        o2 = _mm_add_epi32(o2, _mm_madd_epi16(d, IDCT_K(-11362, -6436)));
+        o1 = _mm_add_epi32(o1, _mm_madd_epi16(d, IDCT_K(2261, 9633)));
+        o0 = _mm_add_epi32(o0, _mm_madd_epi16(d, IDCT_K(9633, -11363)));
+    }
+    r[0] = _mm_add_epi32(t10, o3);
+    r[7] = _mm_sub_epi32(t10, o3);
+    r[1] = _mm_add_epi32(t11, o2);
+    r[6] = _mm_sub_epi32(t11, o2);
+    r[2] = _mm_add_epi32(t12, o1);
+    r[5] = _mm_sub_epi32(t12, o1);
+    r[3] = _mm_add_epi32(t13, o0);
+    r[4] = _mm_sub_epi32(t13, o0);
+}
+
+/* 1-D IDCT across v[0..7], v[n] .. v[7] zero, descaled by bits to 16 bit */
+static DEC_INLINE void idct_sse2_pass(__m128i* v, int bits, int n) {
+    const __m128i rnd = _mm_set1_epi32(1 << (bits - 1));
+    const __m128i sh = _mm_cvtsi32_si128(bits);
+    const __m128i z = _mm_setzero_si128();
+    __m128i v2 = n > 2 ? v[2] : z, v3 = n > 2 ? v[3] : z;
+    __m128i v4 = n > 4 ? v[4] : z, v5 = n > 4 ? v[5] : z;
+    __m128i v6 = n > 4 ? v[6] : z, v7 = n > 4 ? v[7] : z;
+    __m128i lo[8], hi[8];
+    idct_sse2_half(_mm_unpacklo_epi16(v[0], v4), _mm_unpacklo_epi16(v2, v6),
+        _mm_unpacklo_epi16(v[1], v3), _mm_unpacklo_epi16(v5, v7), rnd, n, lo);
+    idct_sse2_half(_mm_unpackhi_epi16(v[0], v4), _mm_unpackhi_epi16(v2, v6),
+        _mm_unpackhi_epi16(v[1], v3), _mm_unpackhi_epi16(v5, v7), rnd, n, hi);
+#define IDCT_OUT(i) v[i] = _mm_packs_epi32(_mm_sra_epi32(lo[i], sh), \
+                                           _mm_sra_epi32(hi[i], sh))
+    IDCT_OUT(0);
+    IDCT_OUT(1);
+    IDCT_OUT(2);
+    IDCT_OUT(3);
+    IDCT_OUT(4);
+    IDCT_OUT(5);
+    IDCT_OUT(6);
+    IDCT_OUT(7);
+#undef IDCT_OUT
+}
+
+static DEC_INLINE void idct_sse2_transpose(__m128i* v) {
+    __m128i a0, a1, a2, a3, a4, a5, a6, a7, b0, b1, b2, b3, b4, b5, b6, b7;
+    a0 = _mm_unpacklo_epi16(v[0], v[1]);
+    a1 = _mm_unpackhi_epi16(v[0], v[1]);
+    a2 = _mm_unpacklo_epi16(v[2], v[3]);
+    a3 = _mm_unpackhi_epi16(v[2], v[3]);
+    a4 = _mm_unpacklo_epi16(v[4], v[5]);
+    a5 = _mm_unpackhi_epi16(v[4], v[5]);
+    a6 = _mm_unpacklo_epi16(v[6], v[7]);
+    a7 = _mm_unpackhi_epi16(v[6], v[7]);
+    b0 = _mm_unpacklo_epi32(a0, a2);
+    b1 = _mm_unpackhi_epi32(a0, a2);
+    b2 = _mm_unpacklo_epi32(a1, a3);
+    b3 = _mm_unpackhi_epi32(a1, a3);
+    b4 = _mm_unpacklo_epi32(a4, a6);
+    b5 = _mm_unpackhi_epi32(a4, a6);
+    b6 = _mm_unpacklo_epi32(a5, a7);
+    b7 = _mm_unpackhi_epi32(a5, a7);
+    v[0] = _mm_unpacklo_epi64(b0, b4);
+    v[1] = _mm_unpackhi_epi64(b0, b4);
+    v[2] = _mm_unpacklo_epi64(b1, b5);
+    v[3] = _mm_unpackhi_epi64(b1, b5);
+    v[4] = _mm_unpacklo_epi64(b2, b6);
+    v[5] = _mm_unpackhi_epi64(b2, b6);
+    v[6] = _mm_unpacklo_epi64(b3, b7);
+    v[7] = _mm_unpackhi_epi64(b3, b7);
+}
 
-      }
+/* dequantized rows of in, those from n on are zero */
+static DEC_INLINE void idct_sse2_load(const int16_t* in,
+                                      const int16_t* quant, __m128i* v,
+                                      int n) {
+    const __m128i z = _mm_setzero_si128();
+#define IDCT_LOAD(i) v[i] = (i) < n ? _mm_mullo_epi16(                     \
+        _mm_loadu_si128((const __m128i*)(in + (i) * 8)),                    \
+        _mm_loadu_si128((const __m128i*)(quant + (i) * 8))) : z
+    IDCT_LOAD(0);
+    IDCT_LOAD(1);
+    IDCT_LOAD(2);
+    IDCT_LOAD(3);
+    IDCT_LOAD(4);
+    IDCT_LOAD(5);
+    IDCT_LOAD(6);
+    IDCT_LOAD(7);
+#undef IDCT_LOAD
+}
 
-        outy += 16;outu +=8; outv +=8;
-        outv1 = 0; outu1=0;
-        outy1 = 0;
-        outy2 = 8;
-        pic0 += 2 * (width -16);
-        pic1 += 2 * (width -16);
+/* rows v[] biased by 128 and saturated to bytes */
+static DEC_INLINE void idct_sse2_store(const __m128i* v, uint8_t* out) {
+    const __m128i k128 = _mm_set1_epi16(128);
+#define IDCT_STORE(i) _mm_storeu_si128((__m128i*)(out + (i) * 8),          \
+        _mm_packus_epi16(_mm_adds_epi16(v[i], k128),                        \
+            _mm_adds_epi16(v[(i) + 1], k128)))
+    IDCT_STORE(0);
+    IDCT_STORE(2);
+    IDCT_STORE(4);
+    IDCT_STORE(6);
+#undef IDCT_STORE
+}
 
+static DEC_INLINE void idct_sse2_n(const int16_t* in, uint8_t* out,
+                                   const int16_t* quant, int n) {
+    __m128i v[8];
+    idct_sse2_load(in, quant, v, n);
+    idct_sse2_pass(v, CONST_BITS - PASS1_BITS, n);
+    idct_sse2_transpose(v);
+    idct_sse2_pass(v, CONST_BITS + PASS1_BITS + 3, n);
+    idct_sse2_transpose(v);
+    idct_sse2_store(v, out);
+}
+
+static void idct_accurate_sse2(const int16_t* in, uint8_t* out,
+                               const int16_t* quant, int n) {
+    switch (n) {    /* constant n drops the zero terms */
+    case 2:
+        idct_sse2_n(in, out, quant, 2);
+        break;
+    case 4:
+        idct_sse2_n(in, out, quant, 4);
+        break;
+    default:
+        idct_sse2_n(in, out, quant, 8);
+        break;
     }
+}
 
+#endif /* DEC_SSE2 */
+
+#ifdef DEC_AVX2
+
+/* pairs of all eight lanes in one pmaddwd, otherwise as the SSE2 kernel */
+
+#define IDCT_K8(a, b) _mm256_setr_epi16(a, b, a, b, a, b, a, b, \
+                                        a, b, a, b, a, b, a, b)
+
+DEC_AVX2_TARGET
+static DEC_INLINE __m256i idct_avx2_pair(__m128i a, __m128i b) {
+    return _mm256_inserti128_si256(_mm256_castsi128_si256(
+        _mm_unpacklo_epi16(a, b)), _mm_unpackhi_epi16(a, b), 1);
 }
 
-static void yuv420pto422(int * out,unsigned char *pic,int width)
-{
-    int j, k;
-    unsigned char *pic0, *pic1;
-    int *outy, *outu, *outv;
-    int outy1 = 0;
-    int outy2 = 8;
-
-
-    pic0 = pic;
-    pic1 = pic + width;
-    outy = out;
-    outu = out + 64 * 4;
-    outv = out + 64 * 5;
-    for (j = 0; j < 8; j++) {
-        for (k = 0; k < 8; k++) {
-        if( k == 4) {
-            outy1 += 56;
-            outy2 += 56;
+DEC_AVX2_TARGET
+static DEC_INLINE void idct_avx2_pass(__m128i* v, int bits, int n) {
+    const __m256i rnd = _mm256_set1_epi32(1 << (bits - 1));
+    const __m128i sh = _mm_cvtsi32_si128(bits);
+    const __m128i z = _mm_setzero_si128();
+    __m256i a, b, c, d, e0, e1, x, y, t10, t11, t12, t13, o0, o1, o2, o3, p;
+    a = idct_avx2_pair(v[0], n > 4 ? v[4] : z);
+    c = idct_avx2_pair(v[1], n > 2 ? v[3] : z);
+    e0 = _mm256_add_epi32(_mm256_madd_epi16(a, IDCT_K8(8192, 8192)), rnd);
+    e1 = _mm256_add_epi32(_mm256_madd_epi16(a, IDCT_K8(8192, -8192)), rnd);
+    x = y = _mm256_setzero_si256();
+    if (n > 2) {
+        b = idct_avx2_pair(v[2], n > 4 ? v[6] : z);
+        x = _mm256_madd_epi16(b, IDCT_K8(10703, 4433));
+        y = _mm256_madd_epi16(b, IDCT_K8(4433, -10704));
+    }
+    t10 = _mm256_add_epi32(e0, x);
+    t13 = _mm256_sub_epi32(e0, x);
+    t11 = _mm256_add_epi32(e1, y);
+    t12 = _mm256_sub_epi32(e1, y);
+    o3 = _mm256_madd_epi16(c, IDCT_K8(11363, 9633));
+    o2 = _mm256_madd_epi16(c, IDCT_K8(9633, -2259));
+    o1 = _mm256_madd_epi16(c, IDCT_K8(6437, -11362));
+    o0 = _mm256_madd_epi16(c, IDCT_K8(2260, -6436));
+    if (n > 4) {
+        d = idct_avx2_pair(v[5], v[7]);
+        o3 = _mm256_add_epi32(o3, _mm256_madd_epi16(d, IDCT_K8(6437, 2260)));
+        o2 = _mm256_add_epi32(o2, _mm256_madd_epi16(d, IDCT_K8(-11362, -6436)));
+        o1 = _mm256_add_epi32(o1, _mm256_madd_epi16(d, IDCT_K8(2261, 9633)));
+        o0 = _mm256_add_epi32(o0, _mm256_madd_epi16(d, IDCT_K8(9633, -11363)));
+    }
+    /* packs interleaves 128 bit lanes, permute restores rows i and j */
+#define IDCT_OUT(i, j, t, o) (                                          \
+        p = _mm256_permute4x64_epi64(_mm256_packs_epi32(                \
+            _mm256_sra_epi32(_mm256_add_epi32(t, o), sh),               \
+            _mm256_sra_epi32(_mm256_sub_epi32(t, o), sh)), 0xD8),       \
+        v[i] = _mm256_castsi256_si128(p),                               \
+        v[j] = _mm256_extracti128_si256(p, 1))
+    IDCT_OUT(0, 7, t10, o3);
+    IDCT_OUT(1, 6, t11, o2);
+    IDCT_OUT(2, 5, t12, o1);
+    IDCT_OUT(3, 4, t13, o0);
+#undef IDCT_OUT
+}
+
+DEC_AVX2_TARGET
+static DEC_INLINE void idct_avx2_n(const int16_t* in, uint8_t* out,
+                                   const int16_t* quant, int n) {
+    __m128i v[8];
+    idct_sse2_load(in, quant, v, n);
+    idct_avx2_pass(v, CONST_BITS - PASS1_BITS, n);
+    idct_sse2_transpose(v);
+    idct_avx2_pass(v, CONST_BITS + PASS1_BITS + 3, n);
+    idct_sse2_transpose(v);
+    idct_sse2_store(v, out);
+}
+
+DEC_AVX2_TARGET
+static void idct_accurate_avx2(const int16_t* in, uint8_t* out,
+                               const int16_t* quant, int n) {
+    switch (n) {
+    case 2:
+        idct_avx2_n(in, out, quant, 2);
+        break;
+    case 4:
+        idct_avx2_n(in, out, quant, 4);
+        break;
+    default:
+        idct_avx2_n(in, out, quant, 8);
+        break;
+    }
+}
+
+static int idct_has_avx2(void) {
+#if defined(_MSC_VER) && !defined(__clang__)
+    int r[4];
+    __cpuid(r, 0);
+    if (r[0] < 7)
+        return 0;
+    __cpuid(r, 1);
+    if ((r[2] & (1 << 27)) == 0 || (r[2] & (1 << 28)) == 0 ||
+        (_xgetbv(0) & 6) != 6)    /* OSXSAVE, AVX, OS saves ymm */
+        return 0;
+    __cpuidex(r, 7, 0);
+    return (r[1] & (1 << 5)) != 0;
+#else
+    return __builtin_cpu_supports("avx2");
+#endif
+}
+
+#endif /* DEC_AVX2 */
+
+/* accurate IDCT kernel for this CPU, all of them produce the same bytes */
+static idct_kernel_t idct_accurate_kernel(void) {
+#ifdef DEC_AVX2
+    if (idct_has_avx2())
+        return idct_accurate_avx2;
+#endif
+#ifdef DEC_SSE2
+    return idct_accurate_sse2;
+#else
+    return idct_accurate;
+#endif
+}
+
+/* reduced IDCTs of scaled decodes (libjpeg jidctred.c): the top left 4x4
+ * or 2x2 samples of out from the 8x8 coefficients, nonzero in the top left
+ * n x n, with the 16 bit dequantization and workspace of the accurate
+ * IDCT. 1x1 is the DC term of idct_block(). Sums are 64 bit, 16 bit inputs
+ * overflow 32 here. */
+
+static void idct_4x4(const int16_t* in, uint8_t* out, const int16_t* quant,
+                     int n) {
+    int16_t c[8] = { 0 }, ws[8 * 4];
+    int64_t tmp0, tmp2, tmp10, tmp12;
+    int i, j, te;
+    for (i = 0; i < 8; i++) {    /* columns, rows never use column 4 */
+        if (i == 4)
+            continue;
+        if (i >= n) {
+            ws[i] = ws[8 + i] = ws[16 + i] = ws[24 + i] = 0;
+            continue;
+        }
+        for (j = 0; j < n; j++)
+            c[j] = (int16_t)(in[j * 8 + i] * quant[j * 8 + i]);
+        if ((c[1] | c[2] | c[3] | c[5] | c[6] | c[7]) == 0) {
+            te = idct_sat16(c[0] * (1 << PASS1_BITS));
+            for (j = 0; j < 4; j++)
+                ws[j * 8 + i] = (int16_t)te;
+            continue;
         }
-        *pic0++ = clip(outy[outy1]);
-        *pic0++ = clip(128 + *outu);
-        *pic0++ = clip(outy[outy1+1]);
-        *pic0++ = clip(128 + *outv);
-        *pic1++ = clip(outy[outy2]);
-        *pic1++ = clip(128 + *outu);
-        *pic1++ = clip(outy[outy2+1]);
-        *pic1++ = clip(128 + *outv);
-       outy1 +=2; outy2 += 2; outu++; outv++;
-      }
-      if(j==3) {
-      outy = out + 128;
-      } else {
-      outy += 16;
-      }
-        outy1 = 0;
-        outy2 = 8;
-        pic0 += 2 * (width -16);
-        pic1 += 2 * (width -16);
+        tmp0 = (int64_t)c[0] * (1 << (CONST_BITS + 1));
+        tmp2 = c[2] * 15137 - c[6] * 6270;
+        tmp10 = tmp0 + tmp2;
+        tmp12 = tmp0 - tmp2;
+        tmp0 = c[7] * -1730 + c[5] * 11893 + c[3] * -17799 + c[1] * 8697;
+        tmp2 = c[7] * -4176 + c[5] * -4926 + c[3] * 7373 + c[1] * 20995;
+        ws[0 * 8 + i] = idct_sat16((int32_t)DESCALE(tmp10 + tmp2,
+            CONST_BITS - PASS1_BITS + 1));
+        ws[3 * 8 + i] = idct_sat16((int32_t)DESCALE(tmp10 - tmp2,
+            CONST_BITS - PASS1_BITS + 1));
+        ws[1 * 8 + i] = idct_sat16((int32_t)DESCALE(tmp12 + tmp0,
+            CONST_BITS - PASS1_BITS + 1));
+        ws[2 * 8 + i] = idct_sat16((int32_t)DESCALE(tmp12 - tmp0,
+            CONST_BITS - PASS1_BITS + 1));
+    }
+    for (i = 0; i < 4; i++) {    /* rows */
+        const int16_t* w = ws + i * 8;
+        uint8_t* o = out + i * 8;
+        if ((w[1] | w[2] | w[3] | w[5] | w[6] | w[7]) == 0) {
+            te = DESCALE(w[0], PASS1_BITS + 3) + 128;
+            memset(o, clip(te), 4);
+            continue;
+        }
+        tmp0 = (int64_t)w[0] * (1 << (CONST_BITS + 1));
+        tmp2 = w[2] * 15137 - w[6] * 6270;
+        tmp10 = tmp0 + tmp2;
+        tmp12 = tmp0 - tmp2;
+        tmp0 = w[7] * -1730 + w[5] * 11893 + w[3] * -17799 + w[1] * 8697;
+        tmp2 = w[7] * -4176 + w[5] * -4926 + w[3] * 7373 + w[1] * 20995;
+        te = (int)DESCALE(tmp10 + tmp2, CONST_BITS + PASS1_BITS + 4) + 128;
+        o[0] = clip(te);
+        te = (int)DESCALE(tmp10 - tmp2, CONST_BITS + PASS1_BITS + 4) + 128;
+        o[3] = clip(te);
+        te = (int)DESCALE(tmp12 + tmp0, CONST_BITS + PASS1_BITS + 4) + 128;
+        o[1] = clip(te);
+        te = (int)DESCALE(tmp12 - tmp0, CONST_BITS + PASS1_BITS + 4) + 128;
+        o[2] = clip(te);
+    }
+}
 
+static void idct_2x2(const int16_t* in, uint8_t* out, const int16_t* quant,
+                     int n) {
+    static const uint8_t cols[5] = { 0, 1, 3, 5, 7 };    /* used by rows */
+    int16_t c[8] = { 0 }, ws[8 * 2];
+    int64_t tmp0, tmp10;
+    int i, j, k, te;
+    for (k = 0; k < 5; k++) {    /* columns */
+        i = cols[k];
+        if (i >= n) {
+            ws[i] = ws[8 + i] = 0;
+            continue;
+        }
+        for (j = 0; j < n; j++)
+            c[j] = (int16_t)(in[j * 8 + i] * quant[j * 8 + i]);
+        if ((c[1] | c[3] | c[5] | c[7]) == 0) {
+            te = idct_sat16(c[0] * (1 << PASS1_BITS));
+            ws[i] = ws[8 + i] = (int16_t)te;
+            continue;
+        }
+        tmp10 = (int64_t)c[0] * (1 << (CONST_BITS + 2));
+        tmp0 = c[7] * -5906 + c[5] * 6967 + c[3] * -10426 +
+            (int64_t)c[1] * 29692;
+        ws[i] = idct_sat16((int32_t)DESCALE(tmp10 + tmp0,
+            CONST_BITS - PASS1_BITS + 2));
+        ws[8 + i] = idct_sat16((int32_t)DESCALE(tmp10 - tmp0,
+            CONST_BITS - PASS1_BITS + 2));
     }
+    for (i = 0; i < 2; i++) {    /* rows */
+        const int16_t* w = ws + i * 8;
+        tmp10 = (int64_t)w[0] * (1 << (CONST_BITS + 2));
+        tmp0 = w[7] * -5906 + w[5] * 6967 + w[3] * -10426 +
+            (int64_t)w[1] * 29692;
+        te = (int)DESCALE(tmp10 + tmp0, CONST_BITS + PASS1_BITS + 5) + 128;
+        out[i * 8] = clip(te);
+        te = (int)DESCALE(tmp10 - tmp0, CONST_BITS + PASS1_BITS + 5) + 128;
+        out[i * 8 + 1] = clip(te);
+    }
+}
+
+/* float IDCT: AAN (libjpeg jidctflt.c), quant holds quantizers scaled by
+ * the AAN factors and 1/8 */
+
+static int idct_round(float x) {    /* no lrintf(): truncate positive */
+    return (int)(x + 16384.5f) - 16384;
+}
+
+static void idct_float(const int16_t* in, uint8_t* out, const float* quant,
+                       int max) {
+    float tmp0, tmp1, tmp2, tmp3, tmp4, tmp5, tmp6, tmp7;
+    float tmp10, tmp11, tmp12, tmp13, z5, z10, z11, z12, z13;
+    float ws[64], c[8];
+    int i, j, te;
+    if (max == 1) {
+        te = idct_round(in[0] * quant[0]) + 128;
+        memset(out, clip(te), 64);
+        return;
+    }
+    for (i = 0; i < 8; i++) {    /* columns */
+        for (j = 0; j < 8; j++)
+            c[j] = in[j * 8 + i] * quant[j * 8 + i];
+        tmp10 = c[0] + c[4];    /* even part */
+        tmp11 = c[0] - c[4];
+        tmp13 = c[2] + c[6];
+        tmp12 = (c[2] - c[6]) * 1.414213562f - tmp13;
+        tmp0 = tmp10 + tmp13;
+        tmp3 = tmp10 - tmp13;
+        tmp1 = tmp11 + tmp12;
+        tmp2 = tmp11 - tmp12;
+        z13 = c[5] + c[3];      /* odd part */
+        z10 = c[5] - c[3];
+        z11 = c[1] + c[7];
+        z12 = c[1] - c[7];
+        tmp7 = z11 + z13;
+        tmp11 = (z11 - z13) * 1.414213562f;
+        z5 = (z10 + z12) * 1.847759065f;
+        tmp10 = z12 * 1.082392200f - z5;
+        tmp12 = z10 * -2.613125930f + z5;
+        tmp6 = tmp12 - tmp7;
+        tmp5 = tmp11 - tmp6;
+        tmp4 = tmp10 + tmp5;
+        ws[0 * 8 + i] = tmp0 + tmp7;
+        ws[7 * 8 + i] = tmp0 - tmp7;
+        ws[1 * 8 + i] = tmp1 + tmp6;
+        ws[6 * 8 + i] = tmp1 - tmp6;
+        ws[2 * 8 + i] = tmp2 + tmp5;
+        ws[5 * 8 + i] = tmp2 - tmp5;
+        ws[4 * 8 + i] = tmp3 + tmp4;
+        ws[3 * 8 + i] = tmp3 - tmp4;
+    }
+    for (i = 0; i < 64; i += 8) {    /* rows */
+        float* w = ws + i;
+        int r[8];
+        tmp10 = w[0] + w[4];
+        tmp11 = w[0] - w[4];
+        tmp13 = w[2] + w[6];
+        tmp12 = (w[2] - w[6]) * 1.414213562f - tmp13;
+        tmp0 = tmp10 + tmp13;
+        tmp3 = tmp10 - tmp13;
+        tmp1 = tmp11 + tmp12;
+        tmp2 = tmp11 - tmp12;
+        z13 = w[5] + w[3];
+        z10 = w[5] - w[3];
+        z11 = w[1] + w[7];
+        z12 = w[1] - w[7];
+        tmp7 = z11 + z13;
+        tmp11 = (z11 - z13) * 1.414213562f;
+        z5 = (z10 + z12) * 1.847759065f;
+        tmp10 = z12 * 1.082392200f - z5;
+        tmp12 = z10 * -2.613125930f + z5;
+        tmp6 = tmp12 - tmp7;
+        tmp5 = tmp11 - tmp6;
+        tmp4 = tmp10 + tmp5;
+        r[0] = idct_round(tmp0 + tmp7);
+        r[7] = idct_round(tmp0 - tmp7);
+        r[1] = idct_round(tmp1 + tmp6);
+        r[6] = idct_round(tmp1 - tmp6);
+        r[2] = idct_round(tmp2 + tmp5);
+        r[5] = idct_round(tmp2 - tmp5);
+        r[4] = idct_round(tmp3 + tmp4);
+        r[3] = idct_round(tmp3 - tmp4);
+        for (j = 0; j < 8; j++) {
+            te = r[j] + 128;
+            out[i + j] = clip(te);
+        }
+    }
+}
+
+static const float aanscale[8] = {
+    1.0f, 1.387039845f, 1.306562965f, 1.175875602f,
+    1.0f, 0.785694958f, 0.541196100f, 0.275899379f
+};
+
+/* natural order dequantization table c for the decoder's DCT method */
+static void idct_tables(int dct, const uint8_t* qin, union dec_quant* q) {
+    int i, j;
+    switch (dct) {
+    case jpeg_dct_accurate:
+        for (i = 0; i < 64; i++)
+            q->a[i] = qin[zig[i]];
+        break;
+    case jpeg_dct_float:
+        for (i = 0; i < 8; i++)
+            for (j = 0; j < 8; j++)
+                q->f[i * 8 + j] = qin[zig[i * 8 + j]] *
+                    aanscale[i] * aanscale[j] / 8;
+        break;
+    default:
+        idctqtab(qin, q->d);
+        break;
+    }
+}
+
+/* Top left n x n region holding every coefficient before zigzag index max:
+ * indices up to 2 lie in 2x2, 4 too when 3 (row 2) is zero, up to 9 in 4x4 */
+static int idct_region(const int16_t* in, int max) {
+    if (max <= 3 || (max <= 5 && in[16] == 0))
+        return 2;
+    return max <= 10 ? 4 : 8;
+}
+
+/* block of natural order coefficients `in` with `max` decoded in zigzag
+ * order to bs (cbs for chroma) x bs samples of component c, rows 8 apart */
+static void idct_block(struct jpeg_decdata* decdata, const int16_t* in,
+                       uint8_t* out, int c, int max) {
+    int i, te, bs = c != 0 ? decdata->cbs : decdata->bs;
+    if (decdata->dct == jpeg_dct_accurate && (max == 1 || bs == 1)) {
+        /* DC only, same rounding as the full and reduced IDCTs */
+        te = idct_sat16((int16_t)(in[0] * decdata->quant[c]->a[0]) *
+            (1 << PASS1_BITS));
+        te = DESCALE(te, PASS1_BITS + 3) + 128;
+        for (i = 0; i < bs; i++)
+            memset(out + i * 8, clip(te), bs);
+        return;
+    }
+    switch (bs) {
+    case 4:
+        idct_4x4(in, out, decdata->quant[c]->a, idct_region(in, max));
+        return;
+    case 2:
+        idct_2x2(in, out, decdata->quant[c]->a, idct_region(in, max));
+        return;
+    }
+    switch (decdata->dct) {
+    case jpeg_dct_accurate:
+        decdata->islow(in, out, decdata->quant[c]->a, idct_region(in, max));
+        break;
+    case jpeg_dct_float:
+        idct_float(in, out, decdata->quant[c]->f, max);
+        break;
+    default:
+        idct(in, out, decdata->quant[c]->d, max);
+        break;
+    }
+}
+
+/****************************************************************/
+/**************        color conversion           ***************/
+/****************************************************************/
+
+/* JFIF YCbCr to RGB with 14 bit constants. The SSE2 and C paths round and
+ * clamp identically and produce the same pixels. */
+
+#define CR_R    22970    /*  1.402    */
+#define CB_G    -5638    /* -0.344136 */
+#define CR_G    -11700   /* -0.714136 */
+#define CB_B    29032    /*  1.772    */
+
+static int dec_bpp(int format) {
+    static const int bpp[] = { 2, 3, 4, 4, 2, 1, 1, 1, 1 };
+    return bpp[format];
+}
 
+static size_t dec_size(int format, int width, int height) {
+    size_t c = (size_t)((width + 1) / 2) * ((height + 1) / 2);
+    switch (format) {
+    case jpeg_format_gray:
+        return (size_t)width * height;
+    case jpeg_format_i420:
+    case jpeg_format_nv12:
+        return (size_t)width * height + 2 * c;
+    case jpeg_format_yuv444p:
+        return (size_t)width * height * 3;
+    default:
+        return (size_t)width * height * dec_bpp(format);
+    }
+}
+
+/* Crop window of `options` in the *w x *h picture: origin to rx, ry and
+ * size to *w, *h. Pairs of yuyv and 2x2 blocks of i420 and nv12 start on
+ * even picture pixels so they share chroma as in the full picture. */
+static int dec_window(struct jpeg_decdata* decdata,
+                      const jpeg_decode_options_t* options, int* w, int* h) {
+    int x = 0, y = 0, cw = 0, ch = 0;
+    if (options != NULL) {
+        x = options->x;
+        y = options->y;
+        cw = options->w;
+        ch = options->h;
+    }
+    if (x < 0 || y < 0 || cw < 0 || ch < 0 || x >= *w || y >= *h)
+        return -1;
+    if (cw == 0 || cw > *w - x)
+        cw = *w - x;
+    if (ch == 0 || ch > *h - y)
+        ch = *h - y;
+    if (decdata->format == jpeg_format_yuyv ||
+        decdata->format == jpeg_format_i420 ||
+        decdata->format == jpeg_format_nv12) {
+        cw += x & 1;
+        x &= ~1;
+    }
+    if (decdata->format == jpeg_format_i420 ||
+        decdata->format == jpeg_format_nv12) {
+        ch += y & 1;
+        y &= ~1;
+    }
+    decdata->rx = x;
+    decdata->ry = y;
+    *w = cw;
+    *h = ch;
+    return 0;
+}
+
+/* Target of a w x h picture at `pic`, chroma planes following the Y plane
+ * of planar formats */
+static void dec_planes(jpeg_decode_target_t* t, int format, uint8_t* pic,
+                       int w, int h) {
+    int c = format == jpeg_format_yuv444p ? 1 : 2;
+    memset(t, 0, sizeof(*t));
+    t->pixels = pic;
+    t->pitch = w * dec_bpp(format);
+    t->w = w;
+    t->h = h;
+    if (format < jpeg_format_i420 || format == jpeg_format_gray)
+        return;
+    t->cpitch = (w + c - 1) / c;
+    t->cb = pic + (size_t)w * h;
+    t->cr = (uint8_t*)t->cb + (size_t)t->cpitch * ((h + c - 1) / c);
+    if (format == jpeg_format_nv12) {
+        t->cpitch *= 2;
+        t->cr = NULL;
+    }
+}
+
+/* Points the output at the origin of `t` after checking the width x height
+ * output fits it. Chroma samples of planar formats keep their place on the
+ * canvas, which needs x, y on a chroma sample. */
+static int dec_target(struct jpeg_decdata* decdata,
+                      const jpeg_decode_target_t* t) {
+    int f = decdata->format, bpp = dec_bpp(f);
+    int w = decdata->width, h = decdata->height;
+    int c = f == jpeg_format_yuv444p ? 1 : 2;
+    int planar = f >= jpeg_format_i420 && f != jpeg_format_gray;
+    if (t->pixels == NULL || t->x < 0 || t->y < 0 ||
+        w > t->w - t->x || h > t->h - t->y || t->pitch / bpp < t->w ||
+        ((f == jpeg_format_yuyv || planar) && t->x % c != 0) ||
+        (planar && t->y % c != 0))
+        return -1;
+    decdata->pic = (uint8_t*)t->pixels + (size_t)t->y * t->pitch +
+        (size_t)t->x * bpp;
+    decdata->pitch = t->pitch;
+    if (!planar)
+        return 0;
+    decdata->cx = decdata->cy = c;
+    decdata->cstep = f == jpeg_format_nv12 ? 2 : 1;
+    decdata->cpitch = t->cpitch;
+    if (t->cb == NULL || (f != jpeg_format_nv12 && t->cr == NULL) ||
+        t->cpitch / decdata->cstep < (t->w + c - 1) / c)
+        return -1;
+    decdata->cb = (uint8_t*)t->cb + (size_t)(t->y / c) * t->cpitch +
+        (size_t)(t->x / c) * decdata->cstep;
+    decdata->cr = f == jpeg_format_nv12 ? decdata->cb + 1 :
+        (uint8_t*)t->cr + (decdata->cb - (uint8_t*)t->cb);
+    return 0;
+}
+
+/* Writes Y, Cb and Cr of the w x h MCU pixels from i0, j0 to the planes at
+ * x, y (only Y for gray). Chroma samples average the cx x cy image chroma
+ * samples they cover inside the picture, past a crop edge too, which is a
+ * plain copy when the image is subsampled the same way. */
+static void dec_output_planar(struct jpeg_decdata* decdata, int x, int y,
+                              int i0, int j0, int w, int h) {
+    int hs = decdata->hs, vs = decdata->vs;
+    int bs = decdata->bs, bsh = decdata->bsh;
+    int cx = decdata->cx, cy = decdata->cy, cs = decdata->cstep;
+    uint8_t* p = decdata->pic + (size_t)y * decdata->pitch + x;
+    const uint8_t* ub = decdata->out + 256;
+    const uint8_t* vb = decdata->out + 320;
+    const uint8_t* yr;
+    uint8_t *pb, *pr;
+    int i, j, a, b, k, n, su, sv, cw, ch, na, nb, ma, mb;
+    for (j = 0; j < h; j++, p += decdata->pitch) {
+        yr = decdata->out + ((j0 + j) >> bsh) * hs * 64 +
+            ((j0 + j) & (bs - 1)) * 8;
+        for (i = 0; i < w; i += n) {
+            k = i0 + i;
+            n = bs - (k & (bs - 1));
+            memcpy(p + i, yr + (k >> bsh) * 64 + (k & (bs - 1)),
+                w - i < n ? w - i : n);
+        }
+    }
+    /* 1/8 scaled MCUs of a single pixel: the top left one of a chroma
+     * sample stores its chroma */
+    if (decdata->format == jpeg_format_gray || x % cx != 0 || y % cy != 0)
+        return;
+    na = bs * hs < cx ? bs * hs : cx;
+    nb = bs * vs < cy ? bs * vs : cy;
+    cw = (w + cx - 1) / cx;
+    ch = (h + cy - 1) / cy;
+    pb = decdata->cb + (size_t)(y / cy) * decdata->cpitch + (size_t)(x / cx) * cs;
+    pr = decdata->cr + (pb - decdata->cb);
+    for (j = 0; j < ch; j++, pb += decdata->cpitch, pr += decdata->cpitch) {
+        if (!decdata->chroma) {
+            for (i = 0; i < cw; i++)
+                pb[i * cs] = pr[i * cs] = 128;
+        } else if (cx == 1 << decdata->chs && cy == 1 << decdata->cvs) {
+            k = (j0 / cy + j) * 8 + i0 / cx;
+            for (i = 0; i < cw; i++) {
+                pb[i * cs] = ub[k + i];
+                pr[i * cs] = vb[k + i];
+            }
+        } else {
+            /* not the MCU padding at the right and bottom edges */
+            mb = decdata->ph - (decdata->ry + y + j * cy);
+            mb = mb < nb ? mb : nb;
+            for (i = 0; i < cw; i++) {
+                ma = decdata->pw - (decdata->rx + x + i * cx);
+                ma = ma < na ? ma : na;
+                su = sv = 0;
+                for (b = 0; b < mb; b++) {
+                    for (a = 0; a < ma; a++) {
+                        k = ((j0 + j * cy + b) >> decdata->cvs) * 8 +
+                            ((i0 + i * cx + a) >> decdata->chs);
+                        su += ub[k];
+                        sv += vb[k];
+                    }
+                }
+                k = ma * mb;
+                pb[i * cs] = (uint8_t)((su + k / 2) / k);
+                pr[i * cs] = (uint8_t)((sv + k / 2) / k);
+            }
+        }
+    }
+}
+
+static void dec_store(uint8_t* p, int format, int r, int g, int b) {
+    switch (format) {
+    case jpeg_format_rgb24:
+        p[0] = (uint8_t)r; p[1] = (uint8_t)g; p[2] = (uint8_t)b;
+        break;
+    case jpeg_format_rgba32:
+        p[0] = (uint8_t)r; p[1] = (uint8_t)g; p[2] = (uint8_t)b; p[3] = 0xff;
+        break;
+    case jpeg_format_bgra32:
+        p[0] = (uint8_t)b; p[1] = (uint8_t)g; p[2] = (uint8_t)r; p[3] = 0xff;
+        break;
+    default: /* jpeg_format_rgb565 */
+        r = (r & 0xf8) << 8 | (g & 0xfc) << 3 | b >> 3;
+        p[0] = (uint8_t)r; p[1] = (uint8_t)(r >> 8);
+        break;
+    }
+}
+
+/* n pixels of y, u and v samples to RGB `format` */
+static void dec_rgb_row(const uint8_t* y, const uint8_t* u, const uint8_t* v,
+                        int n, int format, uint8_t* p) {
+    int i = 0, bpp = dec_bpp(format);
+#ifdef DEC_SSE2
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i ff = _mm_set1_epi8(-1);
+    const __m128i c128 = _mm_set1_epi16(128);
+    const __m128i one = _mm_set1_epi16(1);
+    const __m128i half = _mm_set1_epi32(8192);
+    const __m128i kr = _mm_setr_epi16(CR_R, 8192, CR_R, 8192,
+        CR_R, 8192, CR_R, 8192);
+    const __m128i kg = _mm_setr_epi16(CB_G, CR_G, CB_G, CR_G,
+        CB_G, CR_G, CB_G, CR_G);
+    const __m128i kb = _mm_setr_epi16(CB_B, 8192, CB_B, 8192,
+        CB_B, 8192, CB_B, 8192);
+    for (; i + 8 <= n; i += 8, p += 8 * bpp) {
+        __m128i y16, u16, v16, r16, g16, b16, rg, bb, lo, hi;
+        y16 = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(y + i)), zero);
+        u16 = _mm_sub_epi16(_mm_unpacklo_epi8(
+            _mm_loadl_epi64((const __m128i*)(u + i)), zero), c128);
+        v16 = _mm_sub_epi16(_mm_unpacklo_epi8(
+            _mm_loadl_epi64((const __m128i*)(v + i)), zero), c128);
+        /* (c, 1) . (k, 8192) and (u, v) . (kg) pairs in 32 bit */
+        r16 = _mm_packs_epi32(
+            _mm_srai_epi32(_mm_madd_epi16(_mm_unpacklo_epi16(v16, one), kr), 14),
+            _mm_srai_epi32(_mm_madd_epi16(_mm_unpackhi_epi16(v16, one), kr), 14));
+        g16 = _mm_packs_epi32(
+            _mm_srai_epi32(_mm_add_epi32(_mm_madd_epi16(
+                _mm_unpacklo_epi16(u16, v16), kg), half), 14),
+            _mm_srai_epi32(_mm_add_epi32(_mm_madd_epi16(
+                _mm_unpackhi_epi16(u16, v16), kg), half), 14));
+        b16 = _mm_packs_epi32(
+            _mm_srai_epi32(_mm_madd_epi16(_mm_unpacklo_epi16(u16, one), kb), 14),
+            _mm_srai_epi32(_mm_madd_epi16(_mm_unpackhi_epi16(u16, one), kb), 14));
+        rg = _mm_packus_epi16(_mm_add_epi16(r16, y16), _mm_add_epi16(g16, y16));
+        bb = _mm_packus_epi16(_mm_add_epi16(b16, y16), zero);
+        switch (format) {
+        case jpeg_format_rgba32:
+            lo = _mm_unpacklo_epi8(rg, _mm_srli_si128(rg, 8));
+            hi = _mm_unpacklo_epi8(bb, ff);
+            _mm_storeu_si128((__m128i*)p, _mm_unpacklo_epi16(lo, hi));
+            _mm_storeu_si128((__m128i*)p + 1, _mm_unpackhi_epi16(lo, hi));
+            break;
+        case jpeg_format_bgra32:
+            lo = _mm_unpacklo_epi8(bb, _mm_srli_si128(rg, 8));
+            hi = _mm_unpacklo_epi8(rg, ff);
+            _mm_storeu_si128((__m128i*)p, _mm_unpacklo_epi16(lo, hi));
+            _mm_storeu_si128((__m128i*)p + 1, _mm_unpackhi_epi16(lo, hi));
+            break;
+        case jpeg_format_rgb565:
+            r16 = _mm_unpacklo_epi8(rg, zero);
+            g16 = _mm_unpackhi_epi8(rg, zero);
+            b16 = _mm_unpacklo_epi8(bb, zero);
+            lo = _mm_or_si128(_mm_slli_epi16(_mm_srli_epi16(r16, 3), 11),
+                _mm_or_si128(_mm_slli_epi16(_mm_srli_epi16(g16, 2), 5),
+                    _mm_srli_epi16(b16, 3)));
+            _mm_storeu_si128((__m128i*)p, lo);
+            break;
+        default: { /* jpeg_format_rgb24 */
+            uint8_t t[24];
+            int k;
+            _mm_storeu_si128((__m128i*)t, rg);
+            _mm_storel_epi64((__m128i*)(t + 16), bb);
+            for (k = 0; k < 8; k++) {
+                p[k * 3 + 0] = t[k];
+                p[k * 3 + 1] = t[k + 8];
+                p[k * 3 + 2] = t[k + 16];
+            }
+        } break;
+        }
+    }
+#endif
+    for (; i < n; i++, p += bpp) {
+        int yy = y[i], uu = u[i] - 128, vv = v[i] - 128;
+        dec_store(p, format,
+            clip(yy + ((vv * CR_R + 8192) >> 14)),
+            clip(yy + ((uu * CB_G + vv * CR_G + 8192) >> 14)),
+            clip(yy + ((uu * CB_B + 8192) >> 14)));
+    }
+}
+
+/* Y0 Cb Y1 Cr with chroma of the even pixel, for n pixels from picture
+ * column x (p points at its Y). The even pixel of a pair writes both
+ * chroma, an odd one at the start only its Y. */
+static void dec_yuyv_row(const uint8_t* y, const uint8_t* u,
+                         const uint8_t* v, int n, int x, int width,
+                         uint8_t* p) {
+    int i = 0;
+    if (x & 1)
+        p[i++] = y[0];
+    for (; i + 1 < n; i += 2) {
+        p[i * 2] = y[i];
+        p[i * 2 + 1] = u[i];
+        p[i * 2 + 2] = y[i + 1];
+        p[i * 2 + 3] = v[i];
+    }
+    if (i < n) {
+        p[i * 2] = y[i];
+        p[i * 2 + 1] = u[i];
+        if (x + i + 1 < width)
+            p[i * 2 + 3] = v[i];
+    }
+}
+
+/* Writes the MCU in decdata->out at picture x, y clipped to the crop
+ * window to its place in the output. Luma blocks of the MCU are rows of hs blocks, chroma
+ * blocks (out + 256 and out + 320) are upsampled by replication unless
+ * already at output resolution. Blocks hold bs x bs samples with rows 8
+ * apart. */
+static void dec_output(struct jpeg_decdata* decdata, int x, int y) {
+    static const uint8_t gray[16] = {
+        128, 128, 128, 128, 128, 128, 128, 128,
+        128, 128, 128, 128, 128, 128, 128, 128
+    };
+    uint8_t ybuf[16], ubuf[16], vbuf[16];
+    int hs = decdata->hs, vs = decdata->vs;
+    int bs = decdata->bs, bsh = decdata->bsh;
+    int i0 = decdata->rx > x ? decdata->rx - x : 0;
+    int j0 = decdata->ry > y ? decdata->ry - y : 0;
+    int ox = x + i0 - decdata->rx, oy = y + j0 - decdata->ry;
+    int w = bs * hs - i0, h = bs * vs - j0;
+    int bpp = dec_bpp(decdata->format);
+    uint8_t* p = decdata->pic + (size_t)oy * decdata->pitch + (size_t)ox * bpp;
+    const uint8_t *yr, *ur, *vr;
+    int i, j, k;
+    if (w > decdata->width - ox)
+        w = decdata->width - ox;
+    if (h > decdata->height - oy)
+        h = decdata->height - oy;
+    if (decdata->format >= jpeg_format_i420) {
+        dec_output_planar(decdata, ox, oy, i0, j0, w, h);
+        return;
+    }
+    for (j = j0; j < j0 + h; j++, p += decdata->pitch) {
+        yr = decdata->out + (j >> bsh) * hs * 64 + (j & (bs - 1)) * 8;
+        ur = decdata->out + 256 + (j >> decdata->cvs) * 8;
+        vr = ur + 64;
+        if (hs > 1) {
+            for (i = 0; i < w; i++) {
+                k = i0 + i;
+                ybuf[i] = yr[(k >> bsh) * 64 + (k & (bs - 1))];
+                ubuf[i] = ur[k >> decdata->chs];
+                vbuf[i] = vr[k >> decdata->chs];
+            }
+            yr = ybuf;
+            ur = ubuf;
+            vr = vbuf;
+        } else {
+            yr += i0;
+            ur += i0;
+            vr += i0;
+        }
+        if (!decdata->chroma)
+            ur = vr = gray;
+        if (decdata->format == jpeg_format_yuyv)
+            dec_yuyv_row(yr, ur, vr, w, ox, decdata->width, p);
+        else
+            dec_rgb_row(yr, ur, vr, w, decdata->format, p);
+    }
 }
 
 int
@@ -1309,10 +3142,636 @@ return 0;
 }
 
 
+jpeg_decoder_t* jpeg_decoder_create(void) {
+    jpeg_decoder_t* decoder;
+    decoder = (jpeg_decoder_t*)calloc(1, sizeof(jpeg_decoder_t));
+    if (decoder != NULL)
+        decoder->decdata.islow = idct_accurate_kernel();
+    return decoder;
+}
+
+void jpeg_decoder_destroy(jpeg_decoder_t* decoder) {
+#ifdef DEC_THREADS
+    if (decoder != NULL)
+        dec_pool_destroy(decoder->pool);
+#endif
+    free(decoder);
+}
+
+static int dec_start(jpeg_decoder_t* decoder, void* that, jpeg_read_t read,
+                     const void* data, int* width, int* height, int* comp,
+                     uint8_t** pic, const jpeg_decode_target_t* target,
+                     const jpeg_decode_options_t* options) {
+    jpeg_reader_t* r;
+    int err;
+    if (decoder == NULL || (read == NULL && data == NULL) ||
+        width == NULL || height == NULL || (pic == NULL && target == NULL)) {
+        errno = EINVAL;
+        return -1;
+    }
+    r = &decoder->reader;
+    r->that = that;
+    r->read = read;
+    r->bytes = 0;
+    r->eof = 0;
+    r->p = read != NULL ? r->buffer : (const uint8_t*)data;
+    r->end = read != NULL ? r->buffer : NULL;
+    decoder->info.dri = 0;
+    err = dec_decode(decoder, pic, width, height, options, target);
+    if (err == 0 && comp != NULL)
+        *comp = dec_bpp(decoder->decdata.format);
+    return err;
+}
+
+int jpeg_decoder_decode(jpeg_decoder_t* decoder, void* that,
+    jpeg_read_t read, const void* data, int* width, int* height, int* comp,
+    void* output, const jpeg_decode_options_t* options) {
+    return dec_start(decoder, that, read, data, width, height, comp,
+        (uint8_t**)output, NULL, options);
+}
+
+int jpeg_decoder_decode_to(jpeg_decoder_t* decoder, void* that,
+    jpeg_read_t read, const void* data, int* width, int* height, int* comp,
+    const jpeg_decode_target_t* target, const jpeg_decode_options_t* options) {
+    return dec_start(decoder, that, read, data, width, height, comp, NULL,
+        target, options);
+}
+
+int jpeg_decoder_tables(jpeg_decoder_t* decoder, const void* data,
+    int size) {
+    jpeg_reader_t* r;
+    int i, j, err = 0;
+    if (decoder == NULL || data == NULL || size < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    r = &decoder->reader;
+    r->read = NULL;
+    r->eof = 0;
+    r->p = (const uint8_t*)data;
+    r->end = r->p + size;
+    for (i = 0; i < DEC_HCACHE; i++)
+        decoder->hcache[i].pin = 0;
+    for (i = 0; i < 4; i++)
+        decoder->dhuff[i] = decoder->hpre[i] = NULL;
+    decoder->qdef = decoder->qmask = 0;
+    if (getbyte(decoder) != 0xff || getbyte(decoder) != M_SOI)
+        err = ERR_NO_SOI;
+    else if (readtables(decoder, M_EOI))
+        err = ERR_BAD_TABLES;
+    if (err != 0)
+        return err;
+    for (i = 0; i < DEC_HCACHE; i++)
+        for (j = 0; j < 4; j++)
+            if (decoder->dhuff[j] == &decoder->hcache[i].t)
+                decoder->hcache[i].pin = 1;
+    for (i = 0; i < 4; i++) {
+        decoder->hpre[i] = decoder->dhuff[i];
+        if (decoder->qdef & 1 << i)
+            memcpy(decoder->qpre[i], decoder->quant_table[i], 64);
+    }
+    decoder->qmask = decoder->qdef;
+    return 0;
+}
+
+int jpeg_decode_ex(void* that, jpeg_read_t read, const void* data,
+    int* width, int* height, int* comp, void* output,
+    const jpeg_decode_options_t* options) {
+    jpeg_decoder_t* decoder;
+    int err;
+    if ((read == NULL && data == NULL) || width == NULL || height == NULL ||
+        output == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+    decoder = jpeg_decoder_create();
+    if (decoder == NULL)
+        return -1;
+    err = jpeg_decoder_decode(decoder, that, read, data, width, height, comp,
+        output, options);
+    jpeg_decoder_destroy(decoder);
+    return err;
+}
+
 int jpeg_decode(void* that, jpeg_read_t read, const void* data,
     int* width, int* height, int* comp, void* output) {
-    (void)that; (void)read; (void)data; (void)width; (void)height; (void)comp; (void)output;
-    return -1;
+    return jpeg_decode_ex(that, read, data, width, height, comp, output, NULL);
+}
+
+int jpeg_decode0(uint8_t** pic, uint8_t* buf, int* width, int* height) {
+    int comp;
+    return jpeg_decode_ex(NULL, NULL, buf, width, height, &comp, pic, NULL);
+}
+
+/****************************************************************/
+/**************          header probe             ***************/
+/****************************************************************/
+
+struct dec_probe {
+    void* that;
+    jpeg_read_t read;
+    jpeg_skip_t skip;
+    const uint8_t* data;
+    int size;
+    long pos;
+};
+
+/* next n bytes to buf, skipped when buf is NULL: 0 or ERR_EOF */
+static int dec_probe_get(struct dec_probe* p, uint8_t* buf, int n) {
+    uint8_t drop[256];
+    int k;
+    if (p->read == NULL) {
+        if (n > p->size - p->pos)
+            return ERR_EOF;
+        if (buf != NULL)
+            memcpy(buf, p->data + p->pos, (size_t)n);
+        p->pos += n;
+        return 0;
+    }
+    if (buf == NULL && p->skip != NULL) {
+        if (p->skip(p->that, n) != 0)
+            return ERR_EOF;
+        p->pos += n;
+        return 0;
+    }
+    while (n > 0) {
+        k = buf != NULL || n < (int)sizeof(drop) ? n : (int)sizeof(drop);
+        k = p->read(p->that, buf != NULL ? buf : drop, k);
+        if (k <= 0)
+            return ERR_EOF;
+        if (buf != NULL)
+            buf += k;
+        p->pos += k;
+        n -= k;
+    }
+    return 0;
+}
+
+int jpeg_probe(void* that, jpeg_read_t read, jpeg_skip_t skip,
+    const void* data, int size, jpeg_probe_t* probe) {
+    struct dec_probe p;
+    uint8_t b[128];
+    int m, n, i, t, q, err;
+    if (probe == NULL || (read == NULL && (data == NULL || size < 0))) {
+        errno = EINVAL;
+        return -1;
+    }
+    memset(probe, 0, sizeof(*probe));
+    p.that = that;
+    p.read = read;
+    p.skip = skip;
+    p.data = (const uint8_t*)data;
+    p.size = size;
+    p.pos = 0;
+    if (dec_probe_get(&p, b, 2) || b[0] != 0xff || b[1] != M_SOI)
+        return ERR_NO_SOI;
+    for (;;) {
+        if ((err = dec_probe_get(&p, b, 2)) != 0)
+            return err;
+        if (b[0] != 0xff)
+            return ERR_WRONG_MARKER;
+        while (b[1] == 0xff)    /* fill bytes */
+            if ((err = dec_probe_get(&p, b + 1, 1)) != 0)
+                return err;
+        m = b[1];
+        if (m == M_SOS) {
+            probe->bytes = p.pos - 2;
+            return probe->sof != 0 ? 0 : ERR_WRONG_MARKER;
+        }
+        if (m == 0 || m == M_SOI || m == M_EOI)
+            return ERR_WRONG_MARKER;
+        if ((m & ~0x07) == M_RST0 || m == 0x01)
+            continue;           /* no length */
+        if ((err = dec_probe_get(&p, b, 2)) != 0)
+            return err;
+        n = (b[0] << 8 | b[1]) - 2;
+        if (n < 0)
+            return ERR_WRONG_MARKER;
+        if ((m & 0xf0) == M_SOF0 && m != M_DHT && m != 0xc8 && m != 0xcc &&
+            probe->sof == 0) {
+            if (n < 6)
+                return ERR_WRONG_MARKER;
+            if ((err = dec_probe_get(&p, b, 6)) != 0)
+                return err;
+            probe->sof = m;
+            probe->precision = b[0];
+            probe->height = b[1] << 8 | b[2];
+            probe->width = b[3] << 8 | b[4];
+            probe->comp = b[5];
+            if (probe->comp > MAXCOMP)
+                return ERR_TOO_MANY_COMPPS;
+            n -= 6 + 3 * probe->comp;
+            if (n < 0)
+                return ERR_WRONG_MARKER;
+            if ((err = dec_probe_get(&p, b, 3 * probe->comp)) != 0)
+                return err;
+            for (i = 0; i < probe->comp; i++) {
+                probe->id[i] = b[i * 3];
+                probe->h[i] = b[i * 3 + 1] >> 4;
+                probe->v[i] = b[i * 3 + 1] & 15;
+                probe->tq[i] = b[i * 3 + 2];
+            }
+        } else if (m == M_DQT) {
+            while (n > 0) {
+                if ((err = dec_probe_get(&p, b, 1)) != 0)
+                    return err;
+                t = b[0] & 15;
+                q = b[0] >> 4 ? 2 : 1;  /* bytes per entry */
+                if (t > 3)
+                    return ERR_QUANT_TABLE_SELECTOR;
+                n -= 1 + 64 * q;
+                if (n < 0)
+                    return ERR_WRONG_MARKER;
+                if ((err = dec_probe_get(&p, b, 64 * q)) != 0)
+                    return err;
+                for (i = 0; i < 64; i++)
+                    probe->quant[t][i] = q == 1 ? b[i] :
+                        b[i * 2] << 8 | b[i * 2 + 1];
+                probe->qmask |= 1 << t;
+            }
+        } else if (m == M_DRI) {
+            if (n < 2)
+                return ERR_WRONG_MARKER;
+            if ((err = dec_probe_get(&p, b, 2)) != 0)
+                return err;
+            probe->dri = b[0] << 8 | b[1];
+            n -= 2;
+        } else if (m == M_DHT) {
+            probe->dht = 1;
+        } else if ((m & 0xf0) == M_APP0) {
+            probe->app |= 1 << (m & 15);
+        }
+        if (n > 0 && (err = dec_probe_get(&p, NULL, n)) != 0)
+            return err;
+    }
+}
+
+/****************************************************************/
+/**************          MJPEG streams            ***************/
+/****************************************************************/
+
+/* frame in flight, decoded by its own context from its own copy of the
+ * data into its own picture, all three kept for the frame taking its
+ * place in the ring later */
+struct dec_frame {
+    jpeg_decoder_t* decoder;
+    void* pic;
+    int width, height, comp;
+    const jpeg_decode_options_t* options;
+    uint8_t* data;
+    size_t cap;
+    int err;                /* set ahead for frames not decoded */
+    int done;
+};
+
+enum { DEC_SOI, DEC_SEGMENTS, DEC_ENTROPY };    /* splitter states */
+
+struct jpeg_mjpeg_s {
+    jpeg_decode_options_t options;
+    jpeg_frame_t frame;
+    void* that;
+    int slots;
+    struct dec_frame* frames;   /* ring of slots frames */
+    int head, count;        /* oldest frame, frames in the ring */
+    int index;              /* of the next frame delivered */
+#ifdef DEC_THREADS
+    int threads;            /* workers running, 0: decode in push */
+    struct dec_worker* workers;
+    dec_thread_t* th;
+    dec_mutex_t lock;       /* guards the fields below and done */
+    dec_cond_t work, done;
+    int next, queued;       /* oldest frame not taken by a worker */
+    int stop;
+#endif
+    uint8_t* buf;           /* stream from the first byte still needed */
+    size_t n, cap;
+    int state;              /* DEC_* */
+    size_t start, pos;      /* frame being split, where splitting resumes */
+};
+
+/* first 0xff byte from p, else end */
+static const uint8_t* dec_findff(const uint8_t* p, const uint8_t* end) {
+#ifdef DEC_SSE2
+    const __m128i ff = _mm_set1_epi8(-1);
+    for (; end - p >= 16; p += 16)
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(
+                _mm_loadu_si128((const __m128i*)p), ff)) != 0)
+            break;
+#endif
+    while (p != end && *p != 0xff)
+        p++;
+    return p;
+}
+
+/* Next frame of the stream buffer in [*a, *b), with *err ERR_NO_EOI when
+ * the next SOI cuts it short. Returns 0 when more bytes are needed, the
+ * state kept to resume where it stopped. */
+static int dec_split(jpeg_mjpeg_t* m, size_t* a, size_t* b, int* err) {
+    const uint8_t* buf = m->buf;
+    size_t n = m->n, p = m->pos;
+    int c;
+    for (;;) {
+        switch (m->state) {
+        case DEC_SOI:
+            for (;;) {
+                p = (size_t)(dec_findff(buf + p, buf + n) - buf);
+                if (n - p < 3) {
+                    m->pos = p;
+                    return 0;
+                }
+                if (buf[p + 1] == M_SOI && buf[p + 2] == 0xff)
+                    break;
+                p++;
+            }
+            m->start = p;
+            m->state = DEC_SEGMENTS;
+            p += 2;
+            break;
+        case DEC_SEGMENTS:
+            if (n - p < 2) {
+                m->pos = p;
+                return 0;
+            }
+            c = buf[p + 1];
+            if (buf[p] != 0xff) {   /* no JPEG after all */
+                p = m->start + 1;
+                m->state = DEC_SOI;
+            } else if (c == 0xff) {
+                p++;
+            } else if (c == M_EOI || c == M_SOI) {
+                *a = m->start;
+                *b = c == M_EOI ? p + 2 : p;
+                *err = c == M_EOI ? 0 : ERR_NO_EOI;
+                m->pos = *b;
+                m->state = DEC_SOI;
+                return 1;
+            } else if ((c & ~0x07) == M_RST0 || c == 0x01) {
+                p += 2;             /* no length */
+            } else {
+                c = c == M_SOS;
+                if (n - p < 4 ||
+                    n - p < (size_t)(2 + (buf[p + 2] << 8 | buf[p + 3]))) {
+                    m->pos = p;
+                    return 0;
+                }
+                p += 2 + (buf[p + 2] << 8 | buf[p + 3]);
+                if (c)
+                    m->state = DEC_ENTROPY;
+            }
+            break;
+        default: /* DEC_ENTROPY */
+            p = (size_t)(dec_findff(buf + p, buf + n) - buf);
+            if (n - p < 2) {
+                m->pos = p;
+                return 0;
+            }
+            c = buf[p + 1];
+            if (c == 0xff)
+                p++;
+            else if (c == 0 || (c & ~0x07) == M_RST0)
+                p += 2;
+            else    /* EOI, SOI or tables ahead of another scan */
+                m->state = DEC_SEGMENTS;
+            break;
+        }
+    }
+}
+
+static void dec_frame_decode(struct dec_frame* f) {
+    if (f->err == 0)
+        f->err = jpeg_decoder_decode(f->decoder, NULL, NULL, f->data,
+            &f->width, &f->height, &f->comp, &f->pic, f->options);
+}
+
+#ifdef DEC_THREADS
+/* persistent worker: decodes the frames of the ring in the order queued */
+static void dec_mjpeg_work(struct dec_worker* w) {
+    jpeg_mjpeg_t* m = w->mjpeg;
+    struct dec_frame* f;
+    dec_lock(&m->lock);
+    for (;;) {
+        while (m->queued == 0 && !m->stop)
+            dec_wait(&m->work, &m->lock);
+        if (m->stop)
+            break;
+        f = m->frames + m->next;
+        m->next = (m->next + 1) % m->slots;
+        m->queued--;
+        dec_unlock(&m->lock);
+        dec_frame_decode(f);
+        dec_lock(&m->lock);
+        f->done = 1;
+        dec_wake(&m->done);
+    }
+    dec_unlock(&m->lock);
+}
+#endif
+
+/* Delivers the oldest frames in order as they are done, waiting for them
+ * while more than `keep` frames are in the ring. */
+static void dec_mjpeg_deliver(jpeg_mjpeg_t* m, int keep) {
+    struct dec_frame* f;
+    int done;
+#ifndef DEC_THREADS
+    (void)keep;
+#endif
+    while (m->count > 0) {
+        f = m->frames + m->head;
+#ifdef DEC_THREADS
+        if (m->threads > 0) {
+            dec_lock(&m->lock);
+            while (!f->done && m->count > keep)
+                dec_wait(&m->done, &m->lock);
+            done = f->done;
+            dec_unlock(&m->lock);
+        } else
+#endif
+        done = f->done;
+        if (!done)
+            break;
+        if (f->err == 0)
+            m->frame(m->that, m->index++, 0, f->pic, f->width, f->height,
+                f->comp);
+        else
+            m->frame(m->that, m->index++, f->err, NULL, 0, 0, 0);
+        f->err = 0;
+        f->done = 0;    /* no worker sees the frame until queued again */
+        m->head = (m->head + 1) % m->slots;
+        m->count--;
+    }
+}
+
+/* queues frame [a, b) of the stream buffer, or one failed with err */
+static void dec_mjpeg_add(jpeg_mjpeg_t* m, size_t a, size_t b, int err) {
+    struct dec_frame* f;
+    uint8_t* data;
+    if (m->count == m->slots)
+        dec_mjpeg_deliver(m, m->slots - 1);
+    f = m->frames + (m->head + m->count) % m->slots;
+    m->count++;
+    f->err = err;
+    if (err == 0 && b - a > f->cap) {
+        data = (uint8_t*)realloc(f->data, b - a);
+        if (data != NULL) {
+            f->data = data;
+            f->cap = b - a;
+        } else {
+            f->err = -1;
+        }
+    }
+    if (f->err == 0)    /* the stream buffer moves on while it decodes */
+        memcpy(f->data, m->buf + a, b - a);
+#ifdef DEC_THREADS
+    if (m->threads > 0) {
+        dec_lock(&m->lock);
+        m->queued++;
+        dec_wake(&m->work);
+        dec_unlock(&m->lock);
+        return;
+    }
+#endif
+    dec_frame_decode(f);
+    f->done = 1;
+}
+
+jpeg_mjpeg_t* jpeg_mjpeg_create(int threads,
+    const jpeg_decode_options_t* options, jpeg_frame_t frame, void* that) {
+    jpeg_mjpeg_t* m;
+    int i;
+    if (threads < 0 || frame == NULL) {
+        errno = EINVAL;
+        return NULL;
+    }
+#ifndef DEC_THREADS
+    threads = 1;
+#endif
+    if (threads == 0)
+        threads = 1;
+    m = (jpeg_mjpeg_t*)calloc(1, sizeof(*m));
+    if (m == NULL)
+        return NULL;
+    if (options != NULL)
+        m->options = *options;
+    m->options.threads = 0;
+    m->frame = frame;
+    m->that = that;
+    /* twice the workers: they go on past a slow frame at the head */
+    m->slots = threads > 1 ? 2 * threads : 1;
+    m->frames = (struct dec_frame*)calloc((size_t)m->slots,
+        sizeof(*m->frames));
+    if (m->frames == NULL) {
+        jpeg_mjpeg_destroy(m);
+        return NULL;
+    }
+    for (i = 0; i < m->slots; i++) {
+        m->frames[i].options = &m->options;
+        m->frames[i].decoder = jpeg_decoder_create();
+        if (m->frames[i].decoder == NULL) {
+            jpeg_mjpeg_destroy(m);
+            return NULL;
+        }
+    }
+#ifdef DEC_THREADS
+    if (threads > 1) {
+        m->workers = (struct dec_worker*)calloc((size_t)threads,
+            sizeof(*m->workers));
+        m->th = (dec_thread_t*)malloc((size_t)threads * sizeof(*m->th));
+        if (m->workers == NULL || m->th == NULL) {
+            jpeg_mjpeg_destroy(m);
+            return NULL;
+        }
+        dec_mutex_init(&m->lock);
+        dec_cond_init(&m->work);
+        dec_cond_init(&m->done);
+        /* with no thread started frames are decoded in push */
+        for (; m->threads < threads; m->threads++) {
+            m->workers[m->threads].work = dec_mjpeg_work;
+            m->workers[m->threads].mjpeg = m;
+            if (dec_thread_start(m->th + m->threads,
+                                 m->workers + m->threads))
+                break;
+        }
+    }
+#endif
+    return m;
+}
+
+void jpeg_mjpeg_destroy(jpeg_mjpeg_t* m) {
+    int i;
+    if (m == NULL)
+        return;
+#ifdef DEC_THREADS
+    if (m->workers != NULL && m->th != NULL) {
+        dec_lock(&m->lock);
+        m->stop = 1;
+        dec_wake_all(&m->work);
+        dec_unlock(&m->lock);
+        for (i = 0; i < m->threads; i++)
+            dec_thread_join(m->th[i]);
+        dec_cond_destroy(&m->done);
+        dec_cond_destroy(&m->work);
+        dec_mutex_destroy(&m->lock);
+    }
+    free(m->workers);
+    free(m->th);
+#endif
+    for (i = 0; m->frames != NULL && i < m->slots; i++) {
+        jpeg_decoder_destroy(m->frames[i].decoder);
+        free(m->frames[i].pic);
+        free(m->frames[i].data);
+    }
+    free(m->frames);
+    free(m->buf);
+    free(m);
+}
+
+int jpeg_mjpeg_push(jpeg_mjpeg_t* m, const void* data, int bytes) {
+    size_t a, b, keep;
+    uint8_t* buf;
+    int err;
+    if (m == NULL || bytes < 0 || (data == NULL && bytes > 0)) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (m->n + (size_t)bytes > m->cap) {
+        a = m->cap * 2 > m->n + (size_t)bytes ? m->cap * 2 :
+            m->n + (size_t)bytes;
+        buf = (uint8_t*)realloc(m->buf, a);
+        if (buf == NULL)
+            return -1;
+        m->buf = buf;
+        m->cap = a;
+    }
+    memcpy(m->buf + m->n, data, (size_t)bytes);
+    m->n += (size_t)bytes;
+    while (dec_split(m, &a, &b, &err)) {
+        dec_mjpeg_add(m, a, b, err);
+        dec_mjpeg_deliver(m, m->slots);
+    }
+    dec_mjpeg_deliver(m, m->slots);
+    /* drop what the splitter does not need, frames have their copies */
+    keep = m->state == DEC_SOI ? m->pos : m->start;
+    if (keep > 0) {
+        memmove(m->buf, m->buf + keep, m->n - keep);
+        m->n -= keep;
+        m->pos -= keep;
+        m->start -= m->start >= keep ? keep : m->start;
+    }
+    return 0;
+}
+
+int jpeg_mjpeg_flush(jpeg_mjpeg_t* m) {
+    if (m == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (m->state != DEC_SOI)
+        dec_mjpeg_add(m, m->start, m->start, ERR_EOF);
+    dec_mjpeg_deliver(m, 0);
+    m->index = 0;
+    m->state = DEC_SOI;
+    m->n = m->start = m->pos = 0;
+    return 0;
 }
 
 #ifdef __cplusplus
@@ -2,15 +2,168 @@
 #define jpeg_encode_h
 /* public domain Simple, Minimalistic JPEG writer - http://jonolick.com */
 
+#include <stdint.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
 typedef void (*jpeg_write_t)(void* that, const void *data, int bytes);
 
+#ifndef jpeg_dct_defined
+#define jpeg_dct_defined
+// DCT methods shared by encoder and decoder:
+//   fast      AAN with 8 (encoder) or 11 (decoder) bit integer constants
+//   accurate  LLM with 13 bit integer constants (libjpeg "islow"), SSE2
+//             or AVX2 picked at run time in the decoder
+//   float     AAN in single precision floating point
+// default is float for the encoder and accurate for the decoder
+enum { jpeg_dct_default, jpeg_dct_fast, jpeg_dct_accurate, jpeg_dct_float };
+#endif
+
+enum { jpeg_mark_restart = 1, jpeg_mark_row = 2 };
+
+// called when entropy coded data of restart interval or MCU row `index`
+// has been passed to jpeg_write_t. Restart intervals (including their
+// RSTn marker) are byte aligned; up to 7 bits of an MCU row may still be
+// pending in the bit buffer.
+typedef void (*jpeg_mark_t)(void* that, int mark, int index);
+
 int jpeg_encode(void* that, jpeg_write_t write, const void *data,
     int width, int height, int comp, int quality);
 
+// Per stage counters filled by jpeg_encode_ex() when options->stats is set.
+// Collected only when compiled with jpeg_encode_stats_enabled defined,
+// otherwise *stats is zeroed and the encoder carries no instrumentation.
+// Cycles are TSC ticks on x86, virtual counter ticks on ARM64 and clock()
+// ticks elsewhere. Entropy coding cycles include time spent in write.
+
+typedef struct jpeg_encode_stats_s {
+    uint64_t gather;    // cycles: block gather and RGB to YCbCr
+    uint64_t dct;       // cycles: forward DCT
+    uint64_t quantize;  // cycles: quantization and zigzag
+    uint64_t entropy;   // cycles: Huffman coding and bit packing
+    uint64_t write;     // cycles: inside jpeg_write_t
+    uint64_t blocks;    // 8x8 blocks encoded
+    uint64_t zero_ac;   // blocks with all AC coefficients quantized to zero
+    uint64_t eob;       // EOB (baseline) and EOBRUN (progressive) codes
+    uint64_t zrl;       // ZRL (16 zeros) codes
+    uint64_t stuffed;   // 0x00 bytes stuffed after 0xFF
+    uint64_t writes;    // jpeg_write_t calls
+    uint64_t bytes;     // bytes passed to jpeg_write_t
+} jpeg_encode_stats_t;
+
+typedef struct jpeg_encode_options_s {
+    int quality;     // [1..100] (0: 90)
+    // EXIF orientation [1..8] (0: 1) of the source pixels. The encoder
+    // applies it while gathering 8x8 blocks and writes an upright image
+    // (orientations 5..8 swap output width and height):
+    // 1 normal     2 mirror horizontal   3 rotate 180  4 mirror vertical
+    // 5 transpose  6 rotate 90 clockwise 7 transverse  8 rotate 270 clockwise
+    int orientation;
+    // progressive (SOF2) spectral selection and successive approximation
+    // scans with per scan optimized Huffman tables instead of baseline
+    // sequential (SOF0) single scan. Buffers quantized coefficients of
+    // the whole image (384 bytes per 8x8 pixels).
+    int progressive;
+    int subsampling; // chroma subsampling: 444 (0), 422 (2x1) or 420 (2x2)
+    int restart;     // restart interval in MCUs (0: none), baseline only
+    // raw: write only the entropy coded segment (with RSTn markers) and
+    // no SOI, JFIF, DQT, SOF, DHT, DRI, SOS headers or EOI marker
+    int raw;
+    jpeg_mark_t mark; // optional restart interval and MCU row boundaries
+    // preview: embed 1/8 scale image made of 8x8 block averages as Exif
+    // APP1 thumbnail ahead of the frame header. Baseline buffers the entropy
+    // coded data until the thumbnail is known and does not call mark().
+    // Omitted when it does not fit a 64KB segment even at low quality.
+    int preview;
+    jpeg_encode_stats_t* stats; // optional, see jpeg_encode_stats_t
+    int dct;         // jpeg_dct_* forward DCT method (0: float)
+} jpeg_encode_options_t;
+
+int jpeg_encode_ex(void* that, jpeg_write_t write, const void *data,
+    int width, int height, int comp, const jpeg_encode_options_t* options);
+
+// Rate control for MJPEG streams: quality of each frame is predicted from
+// bits per block of the previous frames so the stream converges to the
+// target bitrate without re-encoding frames that came out too big.
+
+typedef struct jpeg_rate_s {
+    // configuration:
+    int bitrate;        // target bits per second
+    int fps;            // frames per second
+    int buffer;         // virtual buffer size in bits (0: bitrate / 2)
+    int min_quality;    // (0: 5)
+    int max_quality;    // (0: 95)
+    // statistics updated after each frame:
+    int quality;        // quality used for the last frame
+    int predicted;      // predicted bytes of the last frame
+    int bytes;          // actual bytes of the last frame
+    int frames;         // number of encoded frames
+    int overflows;      // frames that overflowed the virtual buffer
+    int underflows;     // frames that drained the virtual buffer
+    long long fullness; // virtual buffer fullness in bits [0..buffer]
+    double complexity;  // bits per block at quantizer scale 100%
+} jpeg_rate_t;
+
+void jpeg_rate_init(jpeg_rate_t* rate, int bitrate, int fps);
+
+int jpeg_encode_rate(jpeg_rate_t* rate, void* that, jpeg_write_t write,
+    const void *data, int width, int height, int comp);
+
+// RTP/JPEG (RFC 2435) packetizer: jpeg_encode_rtp() encodes a frame
+// without JFIF headers straight into RTP payloads of at most mtu bytes:
+// main header, restart header (if options->restart), quantization table
+// header (first packet, quality 100 only) and entropy coded data. Whole
+// restart intervals are kept together in a packet when they fit. RTP
+// header itself (sequence, timestamp, M bit) is left to send(), last is
+// set on the final packet of the frame. Frames up to 2040x2040, chroma
+// subsampled 420 (default) or 422.
+
+enum { jpeg_rtp_max_mtu = 9000 };
+
+typedef void (*jpeg_rtp_send_t)(void* that, const void *payload, int bytes,
+    int last);
+
+typedef struct jpeg_rtp_s {
+    void* that;
+    jpeg_rtp_send_t send;
+    int mtu;        // max payload bytes (0: 1400)
+    // packetizer state:
+    int type;       // RFC 2435 type 0 (422), 1 (420) +64 with restart
+    int q;          // Q field: quality [1..99] or 255 (in-band tables)
+    int width;      // in 8 pixel units
+    int height;
+    int dri;        // restart interval in MCUs
+    int offset;     // fragment offset of the first data byte in packet
+    int header;     // header bytes of the current packet
+    int bytes;      // data bytes in packet
+    int start;      // data offset where current restart interval starts
+    int first;      // packet starts at restart interval boundary (F bit)
+    int count;      // restart interval index of the first data byte
+    int interval;   // current restart interval index
+    uint8_t tables[128]; // luma, chroma quantization in zigzag order
+    uint8_t packet[jpeg_rtp_max_mtu];
+} jpeg_rtp_t;
+
+int jpeg_encode_rtp(jpeg_rtp_t* rtp, const void *data, int width, int height,
+    int comp, const jpeg_encode_options_t* options);
+
+// Estimates jpeg_encode() output size at a given quality by encoding a
+// sparse sample of MCUs (one in every `step`, 0: 8) and counting Huffman
+// bits and stuffed 0x00 bytes with the standard tables. Costs roughly
+// 1/step of a full encode.
+
+typedef struct jpeg_estimate_s {
+    int bytes;      // estimated size of jpeg_encode() output
+    int low;        // ~95% confidence interval [low..high]
+    int high;
+    int samples;    // number of sampled MCUs
+} jpeg_estimate_t;
+
+int jpeg_encode_estimate(const void *data, int width, int height, int comp,
+    int quality, int step, jpeg_estimate_t* estimate);
+
 #ifdef __cplusplus
 }
 #endif
@@ -22,16 +175,52 @@ int jpeg_encode(void* that, jpeg_write_t write, const void *data,
 extern "C" {
 #endif
 
+#include <stddef.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 #include <math.h>
 #include <errno.h>
 
+#ifdef jpeg_encode_stats_enabled
+
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <intrin.h>
+#define jpeg_encode_cycles() __rdtsc()
+#elif defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define jpeg_encode_cycles() __rdtsc()
+#elif defined(__aarch64__)
+static inline uint64_t jpeg_encode_cycles(void) {
+    uint64_t t;
+    __asm__ __volatile__("mrs %0, cntvct_el0" : "=r"(t));
+    return t;
+}
+#else
+#include <time.h>
+#define jpeg_encode_cycles() ((uint64_t)clock())
+#endif
+
+#define jpeg_encode_stat_start(t) const uint64_t t = jpeg_encode_cycles()
+#define jpeg_encode_stat(s, field, v) \
+    do { if ((s) != NULL) { (s)->field += (v); } } while (0)
+
+#else
+
+#define jpeg_encode_stat_start(t) (void)0
+#define jpeg_encode_stat(s, field, v) (void)(s)
+
+#endif
+
+#define jpeg_encode_stat_since(s, field, t) \
+    jpeg_encode_stat(s, field, jpeg_encode_cycles() - (t))
+
 typedef struct jpeg_writer_s jpeg_writer_t;
 
 typedef struct jpeg_writer_s {
     void* that;
     jpeg_write_t write;
+    jpeg_encode_stats_t* stats;
     size_t bytes;
     uint8_t buffer[4 * 1024];
 } jpeg_writer_t;
@@ -43,9 +232,46 @@ static const uint8_t zigzag[] = {
     21, 34, 37, 47, 50, 56, 59, 61, 35, 36, 48, 49, 57, 58, 62, 63
 };
 
+// growable memory sink (output buffered ahead of the headers)
+
+typedef struct jpeg_encode_memory_s {
+    uint8_t* data;
+    size_t bytes;
+    size_t allocated;
+    int error;
+} jpeg_encode_memory_t;
+
+static void jpeg_encode_memory_write(void* that, const void* data, int bytes) {
+    jpeg_encode_memory_t* memory = (jpeg_encode_memory_t*)that;
+    if (memory->error != 0) { return; }
+    if (memory->bytes + bytes > memory->allocated) {
+        size_t n = memory->allocated < 4096 ? 4096 : memory->allocated;
+        while (n < memory->bytes + bytes) { n *= 2; }
+        uint8_t* p = (uint8_t*)realloc(memory->data, n);
+        if (p == NULL) { memory->error = ENOMEM; return; }
+        memory->data = p;
+        memory->allocated = n;
+    }
+    memcpy(memory->data + memory->bytes, data, bytes);
+    memory->bytes += bytes;
+}
+
+static void jpeg_writer_output(jpeg_writer_t* writer, const void* data,
+        size_t bytes) {
+    if (writer->write == jpeg_encode_memory_write) { // not jpeg_write_t
+        writer->write(writer->that, data, (int)bytes);
+        return;
+    }
+    jpeg_encode_stat_start(t);
+    writer->write(writer->that, data, (int)bytes);
+    jpeg_encode_stat_since(writer->stats, write, t);
+    jpeg_encode_stat(writer->stats, writes, 1);
+    jpeg_encode_stat(writer->stats, bytes, bytes);
+}
+
 static void jpeg_writer_flush(jpeg_writer_t* writer) {
     if (writer->bytes > 0) {
-        writer->write(writer->that, writer->buffer, (int)writer->bytes);
+        jpeg_writer_output(writer, writer->buffer, writer->bytes);
         writer->bytes = 0;
     }
 }
@@ -58,9 +284,12 @@ static void jpeg_write_byte(jpeg_writer_t* writer, const uint8_t b) {
 
 static void jpeg_write(jpeg_writer_t* writer, const uint8_t b[], size_t bytes) {
     if (writer->bytes + bytes >= sizeof(writer->buffer)) { jpeg_writer_flush(writer); }
-//  assert(bytes <= sizeof(writer->buffer));
-    memcpy(&writer->buffer[writer->bytes], b, bytes);
-    writer->bytes += bytes;
+    if (bytes >= sizeof(writer->buffer)) { // large blocks bypass the buffer
+        jpeg_writer_output(writer, b, bytes);
+    } else {
+        memcpy(&writer->buffer[writer->bytes], b, bytes);
+        writer->bytes += bytes;
+    }
 }
 
 static void jpeg_encode_write_bits(jpeg_writer_t* writer, int32_t* bitBuf, int32_t *bitCnt, const uint16_t *bs) {
@@ -71,6 +300,7 @@ static void jpeg_encode_write_bits(jpeg_writer_t* writer, int32_t* bitBuf, int32
         jpeg_write_byte(writer, c);
         if (c == 255) {
             jpeg_write_byte(writer, 0);
+            jpeg_encode_stat(writer->stats, stuffed, 1);
         }
         *bitBuf <<= 8;
         *bitCnt -= 8;
@@ -114,6 +344,96 @@ static void jpeg_encode_dct(float* d0, float* d1, float* d2, float* d3,
     *d7 = z11 - z4;
 }
 
+// 1-D AAN forward DCT of 8 integers `stride` apart with 8 bit fixed point
+// constants (libjpeg jfdctfst). Same output scaling as jpeg_encode_dct().
+static void jpeg_encode_dct_fast(int32_t* d, int stride) {
+    #define jpeg_encode_fix8(v, c) (((v) * (c)) >> 8)
+    int32_t tmp0 = d[0 * stride] + d[7 * stride];
+    int32_t tmp7 = d[0 * stride] - d[7 * stride];
+    int32_t tmp1 = d[1 * stride] + d[6 * stride];
+    int32_t tmp6 = d[1 * stride] - d[6 * stride];
+    int32_t tmp2 = d[2 * stride] + d[5 * stride];
+    int32_t tmp5 = d[2 * stride] - d[5 * stride];
+    int32_t tmp3 = d[3 * stride] + d[4 * stride];
+    int32_t tmp4 = d[3 * stride] - d[4 * stride];
+    // Even part
+    int32_t tmp10 = tmp0 + tmp3;
+    int32_t tmp13 = tmp0 - tmp3;
+    int32_t tmp11 = tmp1 + tmp2;
+    int32_t tmp12 = tmp1 - tmp2;
+    d[0 * stride] = tmp10 + tmp11;
+    d[4 * stride] = tmp10 - tmp11;
+    int32_t z1 = jpeg_encode_fix8(tmp12 + tmp13, 181);    // c4
+    d[2 * stride] = tmp13 + z1;
+    d[6 * stride] = tmp13 - z1;
+    // Odd part
+    tmp10 = tmp4 + tmp5;
+    tmp11 = tmp5 + tmp6;
+    tmp12 = tmp6 + tmp7;
+    int32_t z5 = jpeg_encode_fix8(tmp10 - tmp12, 98);     // c6
+    int32_t z2 = jpeg_encode_fix8(tmp10, 139) + z5;       // c2 - c6
+    int32_t z4 = jpeg_encode_fix8(tmp12, 334) + z5;       // c2 + c6
+    int32_t z3 = jpeg_encode_fix8(tmp11, 181);            // c4
+    int32_t z11 = tmp7 + z3;
+    int32_t z13 = tmp7 - z3;
+    d[5 * stride] = z13 + z2;
+    d[3 * stride] = z13 - z2;
+    d[1 * stride] = z11 + z4;
+    d[7 * stride] = z11 - z4;
+    #undef jpeg_encode_fix8
+}
+
+// 1-D LLM forward DCT with 13 bit fixed point constants (libjpeg jfdctint).
+// Rows (pass 1) keep 2 extra fraction bits, columns (pass 2) remove them:
+// output is the DCT scaled by 8 like jpeg_encode_dct() DC term.
+static void jpeg_encode_dct_accurate(int32_t* d, int stride, int pass) {
+    enum { bits = 13, pass1 = 2 };
+    const int shift = pass == 1 ? bits - pass1 : bits + pass1;
+    #define jpeg_encode_descale(v, n) (((v) + (1 << ((n) - 1))) >> (n))
+    int32_t tmp0 = d[0 * stride] + d[7 * stride];
+    int32_t tmp7 = d[0 * stride] - d[7 * stride];
+    int32_t tmp1 = d[1 * stride] + d[6 * stride];
+    int32_t tmp6 = d[1 * stride] - d[6 * stride];
+    int32_t tmp2 = d[2 * stride] + d[5 * stride];
+    int32_t tmp5 = d[2 * stride] - d[5 * stride];
+    int32_t tmp3 = d[3 * stride] + d[4 * stride];
+    int32_t tmp4 = d[3 * stride] - d[4 * stride];
+    // Even part
+    int32_t tmp10 = tmp0 + tmp3;
+    int32_t tmp13 = tmp0 - tmp3;
+    int32_t tmp11 = tmp1 + tmp2;
+    int32_t tmp12 = tmp1 - tmp2;
+    if (pass == 1) {
+        d[0 * stride] = (tmp10 + tmp11) * (1 << pass1);
+        d[4 * stride] = (tmp10 - tmp11) * (1 << pass1);
+    } else {
+        d[0 * stride] = jpeg_encode_descale(tmp10 + tmp11, pass1);
+        d[4 * stride] = jpeg_encode_descale(tmp10 - tmp11, pass1);
+    }
+    int32_t z1 = (tmp12 + tmp13) * 4433;                       // 0.541196100
+    d[2 * stride] = jpeg_encode_descale(z1 + tmp13 * 6270, shift);     // 0.765366865
+    d[6 * stride] = jpeg_encode_descale(z1 - tmp12 * 15137, shift);    // 1.847759065
+    // Odd part
+    z1 = tmp4 + tmp7;
+    int32_t z2 = tmp5 + tmp6;
+    int32_t z3 = tmp4 + tmp6;
+    int32_t z4 = tmp5 + tmp7;
+    int32_t z5 = (z3 + z4) * 9633;     // 1.175875602
+    tmp4 *= 2446;                      // 0.298631336
+    tmp5 *= 16819;                     // 2.053119869
+    tmp6 *= 25172;                     // 3.072711026
+    tmp7 *= 12299;                     // 1.501321110
+    z1 *= -7373;                       // 0.899976223
+    z2 *= -20995;                      // 2.562915447
+    z3 = z3 * -16069 + z5;             // 1.961570560
+    z4 = z4 * -3196 + z5;              // 0.390180644
+    d[7 * stride] = jpeg_encode_descale(tmp4 + z1 + z3, shift);
+    d[5 * stride] = jpeg_encode_descale(tmp5 + z2 + z4, shift);
+    d[3 * stride] = jpeg_encode_descale(tmp6 + z2 + z3, shift);
+    d[1 * stride] = jpeg_encode_descale(tmp7 + z1 + z4, shift);
+    #undef jpeg_encode_descale
+}
+
 static void jpeg_encode_calc_bits(int val, uint16_t bits[2]) {
     int tmp1 = val < 0 ? -val : val;
     val = val < 0 ? val-1 : val;
@@ -124,27 +444,384 @@ static void jpeg_encode_calc_bits(int val, uint16_t bits[2]) {
     bits[0] = val & ((1<<bits[1])-1);
 }
 
-static int jpeg_encode_process(jpeg_writer_t* writer, int32_t* bitBuf, int32_t* bitCnt,
-        float* CDU, float* fdtbl, int DC, const uint16_t HTDC[256][2],
-        const uint16_t HTAC[256][2]) {
-    const uint16_t EOB[2] = { HTAC[0x00][0], HTAC[0x00][1] };
-    const uint16_t M16zeroes[2] = { HTAC[0xF0][0], HTAC[0xF0][1] };
-    // DCT rows
-    for (int i = 0; i < 64; i += 8) {
-        jpeg_encode_dct(&CDU[i + 0], &CDU[i + 1], &CDU[i + 2], &CDU[i + 3],
-                        &CDU[i + 4], &CDU[i + 5], &CDU[i + 6], &CDU[i + 7]);
-    }
-    // DCT columns
-    for (int i = 0; i < 8; i++) {
-        jpeg_encode_dct(&CDU[i + 0], &CDU[i +  8], &CDU[i + 16], &CDU[i+24],
-                        &CDU[i +32], &CDU[i + 40], &CDU[i + 48], &CDU[i+56]);
-    }
-    // Quantize/descale/zigzag the coefficients
-    int DU[64] = {0};
+static const uint8_t std_dc_luminance_nrcodes[] = {0,0,1,5,1,1,1,1,1,1,0,0,0,0,0,0,0};
+static const uint8_t std_dc_luminance_values[] = {0,1,2,3,4,5,6,7,8,9,10,11};
+static const uint8_t std_ac_luminance_nrcodes[] = {0,0,2,1,3,3,2,4,3,5,5,4,4,0,0,1,0x7d};
+static const uint8_t std_ac_luminance_values[] = {
+    0x01,0x02,0x03,0x00,0x04,0x11,0x05,0x12,0x21,0x31,0x41,0x06,
+    0x13,0x51,0x61,0x07,0x22,0x71,0x14,0x32,0x81,0x91,0xa1,0x08,
+    0x23,0x42,0xb1,0xc1,0x15,0x52,0xd1,0xf0,0x24,0x33,0x62,0x72,
+    0x82,0x09,0x0a,0x16,0x17,0x18,0x19,0x1a,0x25,0x26,0x27,0x28,
+    0x29,0x2a,0x34,0x35,0x36,0x37,0x38,0x39,0x3a,0x43,0x44,0x45,
+    0x46,0x47,0x48,0x49,0x4a,0x53,0x54,0x55,0x56,0x57,0x58,0x59,
+    0x5a,0x63,0x64,0x65,0x66,0x67,0x68,0x69,0x6a,0x73,0x74,0x75,
+    0x76,0x77,0x78,0x79,0x7a,0x83,0x84,0x85,0x86,0x87,0x88,0x89,
+    0x8a,0x92,0x93,0x94,0x95,0x96,0x97,0x98,0x99,0x9a,0xa2,0xa3,
+    0xa4,0xa5,0xa6,0xa7,0xa8,0xa9,0xaa,0xb2,0xb3,0xb4,0xb5,0xb6,
+    0xb7,0xb8,0xb9,0xba,0xc2,0xc3,0xc4,0xc5,0xc6,0xc7,0xc8,0xc9,
+    0xca,0xd2,0xd3,0xd4,0xd5,0xd6,0xd7,0xd8,0xd9,0xda,0xe1,0xe2,
+    0xe3,0xe4,0xe5,0xe6,0xe7,0xe8,0xe9,0xea,0xf1,0xf2,0xf3,0xf4,
+    0xf5,0xf6,0xf7,0xf8,0xf9,0xfa
+};
+static const uint8_t std_dc_chrominance_nrcodes[] =
+    {0,0,3,1,1,1,1,1,1,1,1,1,0,0,0,0,0};
+static const uint8_t std_dc_chrominance_values[] =
+    {0,1,2,3,4,5,6,7,8,9,10,11};
+static const uint8_t std_ac_chrominance_nrcodes[] =
+    {0,0,2,1,2,4,4,3,4,7,5,4,4,0,1,2,0x77};
+static const uint8_t std_ac_chrominance_values[] = {
+    0x00,0x01,0x02,0x03,0x11,0x04,0x05,0x21,0x31,0x06,0x12,0x41,
+    0x51,0x07,0x61,0x71,0x13,0x22,0x32,0x81,0x08,0x14,0x42,0x91,
+    0xa1,0xb1,0xc1,0x09,0x23,0x33,0x52,0xf0,0x15,0x62,0x72,0xd1,
+    0x0a,0x16,0x24,0x34,0xe1,0x25,0xf1,0x17,0x18,0x19,0x1a,0x26,
+    0x27,0x28,0x29,0x2a,0x35,0x36,0x37,0x38,0x39,0x3a,0x43,0x44,
+    0x45,0x46,0x47,0x48,0x49,0x4a,0x53,0x54,0x55,0x56,0x57,0x58,
+    0x59,0x5a,0x63,0x64,0x65,0x66,0x67,0x68,0x69,0x6a,0x73,0x74,
+    0x75,0x76,0x77,0x78,0x79,0x7a,0x82,0x83,0x84,0x85,0x86,0x87,
+    0x88,0x89,0x8a,0x92,0x93,0x94,0x95,0x96,0x97,0x98,0x99,0x9a,
+    0xa2,0xa3,0xa4,0xa5,0xa6,0xa7,0xa8,0xa9,0xaa,0xb2,0xb3,0xb4,
+    0xb5,0xb6,0xb7,0xb8,0xb9,0xba,0xc2,0xc3,0xc4,0xc5,0xc6,0xc7,
+    0xc8,0xc9,0xca,0xd2,0xd3,0xd4,0xd5,0xd6,0xd7,0xd8,0xd9,0xda,
+    0xe2,0xe3,0xe4,0xe5,0xe6,0xe7,0xe8,0xe9,0xea,0xf2,0xf3,0xf4,
+    0xf5,0xf6,0xf7,0xf8,0xf9,0xfa
+};
+// Huffman tables
+static const uint16_t YDC_HT[256][2] =
+    { {0,2},{2,3},{3,3},{4,3},{5,3},{6,3},{14,4},
+      {30,5},{62,6},{126,7},{254,8},{510,9}};
+static const uint16_t UVDC_HT[256][2] =
+    { {0,2},{1,2},{2,2},{6,3},{14,4},{30,5},{62,6},
+      {126,7},{254,8},{510,9},{1022,10},{2046,11}};
+static const uint16_t YAC_HT[256][2] = {
+    {10,4},{0,2},{1,2},{4,3},{11,4},{26,5},{120,7},{248,8},{1014,10},
+    {65410,16},{65411,16},
+    {0,0},{0,0},{0,0},{0,0},{0,0},{0,0},{12,4},{27,5},{121,7},{502,9},
+    {2038,11},{65412,16},{65413,16}, {65414,16},{65415,16},{65416,16},
+    {0,0},{0,0},{0,0},{0,0},{0,0},{0,0},{28,5},{249,8},{1015,10},
+    {4084,12},{65417,16},{65418,16},{65419,16},{65420,16},{65421,16},
+    {65422,16},
+    {0,0},{0,0},{0,0},{0,0},{0,0},{0,0},{58,6},{503,9},{4085,12},
+    {65423,16},{65424,16},{65425,16},{65426,16},
+    {65427,16},{65428,16},{65429,16},
+    {0,0},{0,0},{0,0},{0,0},{0,0},{0,0},{59,6},{1016,10},{65430,16},
+    {65431,16},{65432,16},{65433,16},{65434,16},{65435,16},{65436,16},
+    {65437,16},
+    {0,0},{0,0},{0,0},{0,0},{0,0},{0,0},{122,7},{2039,11},{65438,16},
+    {65439,16},{65440,16},{65441,16},{65442,16},{65443,16},{65444,16},
+    {65445,16},
+    {0,0},{0,0},{0,0},{0,0},{0,0},{0,0},{123,7},{4086,12},{65446,16},
+    {65447,16},{65448,16},{65449,16},{65450,16},{65451,16},{65452,16},
+    {65453,16},
+    {0,0},{0,0},{0,0},{0,0},{0,0},{0,0},{250,8},{4087,12},{65454,16},
+    {65455,16},{65456,16},{65457,16},{65458,16},{65459,16},{65460,16},
+    {65461,16},
+    {0,0},{0,0},{0,0},{0,0},{0,0},{0,0},{504,9},{32704,15},{65462,16},
+    {65463,16},{65464,16},{65465,16},{65466,16},{65467,16},{65468,16},
+    {65469,16},
+    {0,0},{0,0},{0,0},{0,0},{0,0},{0,0},{505,9},{65470,16},{65471,16},
+    {65472,16},{65473,16},{65474,16},{65475,16},{65476,16},{65477,16},
+    {65478,16},
+    {0,0},{0,0},{0,0},{0,0},{0,0},{0,0},{506,9},{65479,16},{65480,16},
+    {65481,16},{65482,16},{65483,16},{65484,16},{65485,16},{65486,16},
+    {65487,16},
+    {0,0},{0,0},{0,0},{0,0},{0,0},{0,0},{1017,10},{65488,16},{65489,16},
+    {65490,16},{65491,16},{65492,16},{65493,16},{65494,16},{65495,16},
+    {65496,16},
+    {0,0},{0,0},{0,0},{0,0},{0,0},{0,0},{1018,10},{65497,16},{65498,16},
+    {65499,16},{65500,16},{65501,16},{65502,16},{65503,16},{65504,16},
+    {65505,16},
+    {0,0},{0,0},{0,0},{0,0},{0,0},{0,0},{2040,11},{65506,16},{65507,16},
+    {65508,16},{65509,16},{65510,16},{65511,16},{65512,16},{65513,16},
+    {65514,16},
+    {0,0},{0,0},{0,0},{0,0},{0,0},{0,0},{65515,16},{65516,16},{65517,16},
+    {65518,16},{65519,16},{65520,16},{65521,16},{65522,16},{65523,16},
+    {65524,16},
+    {0,0},{0,0},{0,0},{0,0},{0,0},
+    {2041,11},{65525,16},{65526,16},{65527,16},{65528,16},{65529,16},
+    {65530,16},{65531,16},{65532,16},{65533,16},{65534,16},
+    {0,0},{0,0},{0,0},{0,0},{0,0}
+};
+static const uint16_t UVAC_HT[256][2] = {
+    {0,2},{1,2},{4,3},{10,4},{24,5},{25,5},{56,6},{120,7},{500,9},{1014,10},{4084,12},
+    {0,0},{0,0},{0,0},{0,0},{0,0},{0,0},
+    {11,4},{57,6},{246,8},{501,9},{2038,11},{4085,12},{65416,16},{65417,16},{65418,16},{65419,16},
+    {0,0},{0,0},{0,0},{0,0},{0,0},{0,0},
+    {26,5},{247,8},{1015,10},{4086,12},{32706,15},{65420,16},{65421,16},{65422,16},{65423,16},{65424,16},{0,0},
+    {0,0},{0,0},{0,0},{0,0},{0,0},
+    {27,5},{248,8},{1016,10},{4087,12},{65425,16},{65426,16},{65427,16},{65428,16},{65429,16},{65430,16},
+    {0,0},{0,0},{0,0},{0,0},{0,0},{0,0},
+    {58,6},{502,9},{65431,16},{65432,16},{65433,16},{65434,16},{65435,16},{65436,16},{65437,16},{65438,16},
+    {0,0},{0,0},{0,0},{0,0},{0,0},{0,0},
+    {59,6},{1017,10},{65439,16},{65440,16},{65441,16},{65442,16},{65443,16},{65444,16},{65445,16},{65446,16},
+    {0,0},{0,0},{0,0},{0,0},{0,0},{0,0},
+    {121,7},{2039,11},{65447,16},{65448,16},{65449,16},{65450,16},{65451,16},{65452,16},{65453,16},{65454,16},
+    {0,0},{0,0},{0,0},{0,0},{0,0},{0,0},
+    {122,7},{2040,11},{65455,16},{65456,16},{65457,16},{65458,16},{65459,16},{65460,16},{65461,16},{65462,16},
+    {0,0},{0,0},{0,0},{0,0},{0,0},{0,0},
+    {249,8},{65463,16},{65464,16},{65465,16},{65466,16},{65467,16},{65468,16},{65469,16},{65470,16},{65471,16},
+    {0,0},{0,0},{0,0},{0,0},{0,0},{0,0},
+    {503,9},{65472,16},{65473,16},{65474,16},{65475,16},{65476,16},{65477,16},{65478,16},{65479,16},{65480,16},
+    {0,0},{0,0},{0,0},{0,0},{0,0},{0,0},
+    {504,9},{65481,16},{65482,16},{65483,16},{65484,16},{65485,16},{65486,16},{65487,16},{65488,16},{65489,16},
+    {0,0},{0,0},{0,0},{0,0},{0,0},{0,0},
+    {505,9},{65490,16},{65491,16},{65492,16},{65493,16},{65494,16},{65495,16},{65496,16},{65497,16},{65498,16},
+    {0,0},{0,0},{0,0},{0,0},{0,0},{0,0},
+    {506,9},{65499,16},{65500,16},{65501,16},{65502,16},{65503,16},{65504,16},{65505,16},{65506,16},{65507,16},
+    {0,0},{0,0},{0,0},{0,0},{0,0},{0,0},
+    {2041,11},{65508,16},{65509,16},{65510,16},{65511,16},{65512,16},{65513,16},{65514,16},{65515,16},{65516,16},
+    {0,0},{0,0},{0,0},{0,0},{0,0},{0,0},
+    {16352,14},{65517,16},{65518,16},{65519,16},{65520,16},{65521,16},{65522,16},{65523,16},{65524,16},{65525,16},
+    {0,0},{0,0},{0,0},{0,0},{0,0},
+    {1018,10},{32707,15},{65526,16},{65527,16},{65528,16},{65529,16},{65530,16},{65531,16},{65532,16},{65533,16},{65534,16},
+    {0,0},{0,0},{0,0},{0,0},{0,0}
+};
+static const int YQT[] = {
+    16,11,10,16,24,40,51,61,12,12,14,19,26,58,60,55,14,13,16,24,40,57,69,56,
+    14,17,22,29,51,87,80,62,18,22,37,56,68,109,103,77,24,35,55,64,81,104,113,
+    92,49,64,78,87,103,121,120,101,72,92,95,98,112,100,103,99};
+static const int UVQT[] = {17,18,24,47,99,99,99,99,18,21,26,66,99,99,99,99,
+    24,26,56,99,99,99,99,99,47,66,99,99,99,99,99,99,99,99,99,99,99,99,99,99,
+    99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99};
+static const float aasf[] = {
+    1.0f * 2.828427125f, 1.387039845f * 2.828427125f, 1.306562965f * 2.828427125f,
+    1.175875602f * 2.828427125f, 1.0f * 2.828427125f, 0.785694958f * 2.828427125f,
+    0.541196100f * 2.828427125f, 0.275899379f * 2.828427125f };
+// quality [1..100] to quantization tables scale in percent [2..5000]
+static int jpeg_encode_scale(int quality) {
+    quality = quality <= 0 ? 90 : quality;
+    quality = quality < 1 ? 1 : quality > 100 ? 100 : quality;
+    return quality < 50 ? 5000 / quality : 200 - quality * 2;
+}
+
+static int jpeg_encode_quality(double scale) { // inverse of jpeg_encode_scale()
+    int quality = scale >= 100 ? (int)(5000 / scale + 0.5) :
+                                 (int)((200 - scale) / 2 + 0.5);
+    return quality < 1 ? 1 : quality > 100 ? 100 : quality;
+}
+
+// CDU is replaced by its DCT (DC term is 64 times the average for all methods)
+static void jpeg_encode_quantize(float* CDU, const float* fdtbl, int dct,
+        int DU[64], jpeg_encode_stats_t* stats) {
+    jpeg_encode_stat_start(t0);
+    if (dct == jpeg_dct_fast || dct == jpeg_dct_accurate) {
+        int32_t d[64];
+        for (int i = 0; i < 64; i++) { // round samples to integers
+            d[i] = (int32_t)(CDU[i] + 256.5f) - 256;
+        }
+        for (int i = 0; i < 8; i++) {
+            if (dct == jpeg_dct_fast) {
+                jpeg_encode_dct_fast(&d[i * 8], 1);
+            } else {
+                jpeg_encode_dct_accurate(&d[i * 8], 1, 1);
+            }
+        }
+        for (int i = 0; i < 8; i++) {
+            if (dct == jpeg_dct_fast) {
+                jpeg_encode_dct_fast(&d[i], 8);
+            } else {
+                jpeg_encode_dct_accurate(&d[i], 8, 2);
+            }
+        }
+        for (int i = 0; i < 64; i++) { CDU[i] = (float)d[i]; }
+    } else {
+        // DCT rows
+        for (int i = 0; i < 64; i += 8) {
+            jpeg_encode_dct(&CDU[i + 0], &CDU[i + 1], &CDU[i + 2], &CDU[i + 3],
+                            &CDU[i + 4], &CDU[i + 5], &CDU[i + 6], &CDU[i + 7]);
+        }
+        // DCT columns
+        for (int i = 0; i < 8; i++) {
+            jpeg_encode_dct(&CDU[i + 0], &CDU[i +  8], &CDU[i + 16], &CDU[i+24],
+                            &CDU[i +32], &CDU[i + 40], &CDU[i + 48], &CDU[i+56]);
+        }
+    }
+    jpeg_encode_stat_since(stats, dct, t0);
+    jpeg_encode_stat_start(t1);
+    // Quantize/descale/zigzag the coefficients (truncation of v -/+ 0.5
+    // rounds half away from zero without branches or ceilf()/floorf())
     for (int i = 0; i < 64; i++) {
         float v = CDU[i]*fdtbl[i];
-        DU[zigzag[i]] = (int)(v < 0 ? ceilf(v - 0.5f) : floorf(v + 0.5f));
+        DU[zigzag[i]] = (int)(v + copysignf(0.5f, v));
     }
+    jpeg_encode_stat_since(stats, quantize, t1);
+    jpeg_encode_stat(stats, blocks, 1);
+}
+
+// fdtbl: reciprocals of quantizers scaled to the output of the `dct` method
+static void jpeg_encode_tables(int quality, int dct,
+        uint8_t YTable[64], uint8_t UVTable[64],
+        float fdtbl_Y[64], float fdtbl_UV[64]) {
+    quality = jpeg_encode_scale(quality);
+    for (int i = 0; i < 64; i++) {
+        int yti = (YQT[i] * quality + 50) / 100;
+        YTable[zigzag[i]] = (uint8_t)(yti < 1 ? 1 : yti > 255 ? 255 : yti);
+        int uvti  = (UVQT[i] * quality + 50) / 100;
+        UVTable[zigzag[i]] = (uint8_t)(uvti < 1 ? 1 : uvti > 255 ? 255 : uvti);
+    }
+    for (int row = 0, k = 0; row < 8; row++) {
+        for (int col = 0; col < 8; col++) {
+            const float scale = dct == jpeg_dct_accurate ?
+                                8 : aasf[row] * aasf[col];
+            fdtbl_Y[k]  = 1 / (YTable [zigzag[k]] * scale);
+            fdtbl_UV[k] = 1 / (UVTable[zigzag[k]] * scale);
+            k++;
+        }
+    }
+}
+
+typedef struct jpeg_encode_source_s {
+    const uint8_t* data;
+    int width;        // upright
+    int height;
+    int comp;
+    ptrdiff_t origin; // byte offset of upright pixel (0, 0)
+    ptrdiff_t dx;     // byte step for upright x + 1
+    ptrdiff_t dy;     // byte step for upright y + 1
+} jpeg_encode_source_t;
+
+static void jpeg_encode_source(jpeg_encode_source_t* source, const void *data,
+        int width, int height, int comp, int orientation) {
+    const ptrdiff_t c = comp;
+    const ptrdiff_t w = width;
+    const ptrdiff_t h = height;
+    const ptrdiff_t stride = w * c;
+    const int transposed = orientation >= 5;
+    source->data = (const uint8_t*)data;
+    source->width = transposed ? height : width;
+    source->height = transposed ? width : height;
+    source->comp = comp;
+    switch (orientation) {
+        case 2: source->origin = (w - 1) * c;
+                source->dx = -c;      source->dy = +stride; break;
+        case 3: source->origin = (h - 1) * stride + (w - 1) * c;
+                source->dx = -c;      source->dy = -stride; break;
+        case 4: source->origin = (h - 1) * stride;
+                source->dx = +c;      source->dy = -stride; break;
+        case 5: source->origin = 0;
+                source->dx = +stride; source->dy = +c;      break;
+        case 6: source->origin = (h - 1) * stride;
+                source->dx = -stride; source->dy = +c;      break;
+        case 7: source->origin = (h - 1) * stride + (w - 1) * c;
+                source->dx = -stride; source->dy = -c;      break;
+        case 8: source->origin = (w - 1) * c;
+                source->dx = +stride; source->dy = -c;      break;
+        default:source->origin = 0;
+                source->dx = +c;      source->dy = +stride; break;
+    }
+}
+
+// gather upright 8x8 block at (x, y) converted to YCbCr, edges replicated
+static void jpeg_encode_gather(const jpeg_encode_source_t* source, int x, int y,
+        float YDU[64], float UDU[64], float VDU[64]) {
+    const int comp = source->comp;
+    int ofsG = comp > 1 ? 1 : 0, ofsB = comp > 1 ? 2 : 0;
+    for (int row = y, pos = 0; row < y + 8; row++) {
+        const int ry = row < source->height ? row : source->height - 1;
+        const uint8_t* line = source->data + source->origin + ry * source->dy;
+        for (int col = x; col < x + 8; col++) {
+            const int cx = col < source->width ? col : source->width - 1;
+            const uint8_t* p = line + cx * source->dx;
+            float r = p[0];
+            float g = p[ofsG];
+            float b = p[ofsB];
+            YDU[pos] = +0.29900f*r + 0.58700f * g + 0.11400f * b - 128;
+            UDU[pos] = -0.16874f*r - 0.33126f * g + 0.50000f * b;
+            VDU[pos] = +0.50000f*r - 0.41869f * g - 0.08131f * b;
+            pos++;
+        }
+    }
+}
+
+// gather H x V luma blocks at (x, y) and chroma averaged over H x V pixels
+static void jpeg_encode_gather_mcu(const jpeg_encode_source_t* source,
+        int x, int y, int H, int V,
+        float YDU[4][64], float UDU[64], float VDU[64]) {
+    if (H == 1 && V == 1) {
+        jpeg_encode_gather(source, x, y, YDU[0], UDU, VDU);
+        return;
+    }
+    const float scale = 1.0f / (H * V);
+    for (int v = 0; v < V; v++) {
+        for (int h = 0; h < H; h++) {
+            float U[64], W[64];
+            jpeg_encode_gather(source, x + h * 8, y + v * 8, YDU[v * H + h], U, W);
+            for (int row = 0; row < 8; row += V) {
+                for (int col = 0; col < 8; col += H) {
+                    float u = 0, w = 0;
+                    for (int dy = 0; dy < V; dy++) {
+                        for (int dx = 0; dx < H; dx++) {
+                            u += U[(row + dy) * 8 + col + dx];
+                            w += W[(row + dy) * 8 + col + dx];
+                        }
+                    }
+                    int pos = (v * 8 + row) / V * 8 + (h * 8 + col) / H;
+                    UDU[pos] = u * scale;
+                    VDU[pos] = w * scale;
+                }
+            }
+        }
+    }
+}
+
+// bit sink of jpeg_encode_count(): tracks the byte alignment of the
+// sampled stream to count the 0xFF bytes that the writer stuffs with 0x00
+typedef struct jpeg_encode_counter_s {
+    int32_t bitBuf;
+    int32_t bitCnt;
+    int64_t bits;    // including 8 per stuffed 0x00
+} jpeg_encode_counter_t;
+
+static void jpeg_encode_count_bits(jpeg_encode_counter_t* counter, const uint16_t *bs) {
+    counter->bits += bs[1];
+    counter->bitCnt += bs[1];
+    counter->bitBuf |= bs[0] << (24 - counter->bitCnt);
+    while (counter->bitCnt >= 8) {
+        if (((counter->bitBuf >> 16) & 255) == 255) {
+            counter->bits += 8;
+        }
+        counter->bitBuf = (int32_t)((uint32_t)counter->bitBuf << 8);
+        counter->bitCnt -= 8;
+    }
+}
+
+// feeds counter the bits jpeg_encode_process() would write for quantized DU
+static void jpeg_encode_count(jpeg_encode_counter_t* counter, const int DU[64], int DC,
+        const uint16_t HTDC[256][2], const uint16_t HTAC[256][2]) {
+    uint16_t bits[2];
+    int diff = DU[0] - DC;
+    if (diff == 0) {
+        jpeg_encode_count_bits(counter, HTDC[0]);
+    } else {
+        jpeg_encode_calc_bits(diff, bits);
+        jpeg_encode_count_bits(counter, HTDC[bits[1]]);
+        jpeg_encode_count_bits(counter, bits);
+    }
+    int end0pos = 63;
+    for (; (end0pos>0)&&(DU[end0pos]==0); --end0pos) {
+    }
+    for (int i = 1; i <= end0pos; i++) {
+        int startpos = i;
+        for (; DU[i]==0 && i<=end0pos; i++) {
+        }
+        int nrzeroes = i-startpos;
+        for (int k = 0; k < (nrzeroes >> 4); k++) {
+            jpeg_encode_count_bits(counter, HTAC[0xF0]);
+        }
+        nrzeroes &= 15;
+        jpeg_encode_calc_bits(DU[i], bits);
+        jpeg_encode_count_bits(counter, HTAC[(nrzeroes<<4) + bits[1]]);
+        jpeg_encode_count_bits(counter, bits);
+    }
+    if (end0pos != 63) {
+        jpeg_encode_count_bits(counter, HTAC[0x00]);
+    }
+}
+
+static void jpeg_encode_huffman(jpeg_writer_t* writer, int32_t* bitBuf, int32_t* bitCnt,
+        const int DU[64], int DC, const uint16_t HTDC[256][2],
+        const uint16_t HTAC[256][2]) {
+    const uint16_t EOB[2] = { HTAC[0x00][0], HTAC[0x00][1] };
+    const uint16_t M16zeroes[2] = { HTAC[0xF0][0], HTAC[0xF0][1] };
     // Encode DC
     int diff = DU[0] - DC;
     if (diff == 0) {
@@ -162,7 +839,9 @@ static int jpeg_encode_process(jpeg_writer_t* writer, int32_t* bitBuf, int32_t*
     // end0pos = first element in reverse order !=0
     if (end0pos == 0) {
         jpeg_encode_write_bits(writer, bitBuf, bitCnt, EOB);
-        return DU[0];
+        jpeg_encode_stat(writer->stats, zero_ac, 1);
+        jpeg_encode_stat(writer->stats, eob, 1);
+        return;
     }
     for (int i = 1; i <= end0pos; i++) {
         int startpos = i;
@@ -171,6 +850,7 @@ static int jpeg_encode_process(jpeg_writer_t* writer, int32_t* bitBuf, int32_t*
         int nrzeroes = i-startpos;
         if ( nrzeroes >= 16 ) {
             int lng = nrzeroes>>4;
+            jpeg_encode_stat(writer->stats, zrl, lng);
             for (int nrmarker=1; nrmarker <= lng; nrmarker++) {
                 jpeg_encode_write_bits(writer, bitBuf, bitCnt, M16zeroes);
             }
@@ -183,253 +863,1023 @@ static int jpeg_encode_process(jpeg_writer_t* writer, int32_t* bitBuf, int32_t*
     }
     if (end0pos != 63) {
         jpeg_encode_write_bits(writer, bitBuf, bitCnt, EOB);
+        jpeg_encode_stat(writer->stats, eob, 1);
     }
+}
+
+static int jpeg_encode_process(jpeg_writer_t* writer, int32_t* bitBuf, int32_t* bitCnt,
+        float* CDU, float* fdtbl, int dct, int DC, const uint16_t HTDC[256][2],
+        const uint16_t HTAC[256][2]) {
+    int DU[64];
+    jpeg_encode_quantize(CDU, fdtbl, dct, DU, writer->stats);
+    jpeg_encode_stat_start(t);
+    jpeg_encode_huffman(writer, bitBuf, bitCnt, DU, DC, HTDC, HTAC);
+    jpeg_encode_stat_since(writer->stats, entropy, t);
     return DU[0];
 }
 
+// Progressive encoding
+
+enum { jpeg_encode_corr_bits = 1000 }; // max buffered correction bits
+
+typedef struct jpeg_encode_huff_s {
+    uint8_t bits[17];       // number of codes of each length [1..16]
+    uint8_t vals[256];      // symbols in order of increasing code length
+    int count;              // number of symbols
+    uint16_t codes[256][2];
+    long freq[257];         // freq[256] reserves all ones code point
+} jpeg_encode_huff_t;
+
+typedef struct jpeg_encode_scan_s {
+    jpeg_writer_t* writer;
+    int32_t bitBuf;
+    int32_t bitCnt;
+    int gather;             // only count symbol frequencies
+    unsigned int EOBRUN;    // number of pending end of band blocks
+    unsigned int BE;        // correction bits buffered with EOBRUN
+    uint8_t corr[jpeg_encode_corr_bits];
+} jpeg_encode_scan_t;
+
+typedef struct jpeg_encode_script_s {
+    uint8_t comps;
+    uint8_t comp[3];
+    uint8_t Ss, Se, Ah, Al;
+} jpeg_encode_script_t;
+
+// libjpeg jpeg_simple_progression() script for YCbCr
+static const jpeg_encode_script_t jpeg_encode_script[] = {
+    { 3, {0, 1, 2}, 0,  0, 0, 1 }, // DC first
+    { 1, {0},       1,  5, 0, 2 }, // Y AC low frequencies
+    { 1, {2},       1, 63, 0, 1 },
+    { 1, {1},       1, 63, 0, 1 },
+    { 1, {0},       6, 63, 0, 2 },
+    { 1, {0},       1, 63, 2, 1 }, // Y AC refinement
+    { 3, {0, 1, 2}, 0,  0, 1, 0 }, // DC refinement
+    { 1, {2},       1, 63, 1, 0 },
+    { 1, {1},       1, 63, 1, 0 },
+    { 1, {0},       1, 63, 1, 0 }  // Y AC last bit
+};
+
+// optimal length limited Huffman table (ITU T.81 Annex K.2)
+static void jpeg_encode_optimize(jpeg_encode_huff_t* huff) {
+    uint8_t bits[33] = {0};
+    int codesize[257] = {0};
+    int others[257];
+    for (int i = 0; i < 257; i++) { others[i] = -1; }
+    long freq[257];
+    memcpy(freq, huff->freq, sizeof(freq));
+    freq[256] = 1;
+    for (;;) {
+        int c1 = -1;
+        int c2 = -1;
+        long v = 1000000000L;
+        for (int i = 0; i <= 256; i++) {
+            if (freq[i] && freq[i] <= v) { v = freq[i]; c1 = i; }
+        }
+        v = 1000000000L;
+        for (int i = 0; i <= 256; i++) {
+            if (freq[i] && freq[i] <= v && i != c1) { v = freq[i]; c2 = i; }
+        }
+        if (c2 < 0) { break; }
+        freq[c1] += freq[c2];
+        freq[c2] = 0;
+        codesize[c1]++;
+        while (others[c1] >= 0) { c1 = others[c1]; codesize[c1]++; }
+        others[c1] = c2;
+        codesize[c2]++;
+        while (others[c2] >= 0) { c2 = others[c2]; codesize[c2]++; }
+    }
+    for (int i = 0; i <= 256; i++) {
+        if (codesize[i]) { bits[codesize[i]]++; }
+    }
+    int i = 32;
+    for (; i > 16; i--) { // limit code length to 16 bits
+        while (bits[i] > 0) {
+            int j = i - 2;
+            while (bits[j] == 0) { j--; }
+            bits[i] -= 2;
+            bits[i - 1]++;
+            bits[j + 1] += 2;
+            bits[j]--;
+        }
+    }
+    while (bits[i] == 0) { i--; }
+    bits[i]--; // remove reserved code point
+    memcpy(huff->bits, bits, sizeof(huff->bits));
+    huff->count = 0;
+    for (int n = 1; n <= 32; n++) {
+        for (int k = 0; k < 256; k++) {
+            if (codesize[k] == n) { huff->vals[huff->count++] = (uint8_t)k; }
+        }
+    }
+    memset(huff->codes, 0, sizeof(huff->codes));
+    for (int n = 1, k = 0, code = 0; n <= 16; n++, code <<= 1) {
+        for (int j = 0; j < huff->bits[n]; j++, k++, code++) {
+            huff->codes[huff->vals[k]][0] = (uint16_t)code;
+            huff->codes[huff->vals[k]][1] = (uint16_t)n;
+        }
+    }
+}
+
+static void jpeg_encode_emit_symbol(jpeg_encode_scan_t* scan,
+        jpeg_encode_huff_t* huff, int symbol) {
+    if (scan->gather) {
+        huff->freq[symbol]++;
+    } else {
+        jpeg_encode_write_bits(scan->writer, &scan->bitBuf, &scan->bitCnt,
+                               huff->codes[symbol]);
+        if (symbol == 0xF0) { // ZRL, never a DC symbol
+            jpeg_encode_stat(scan->writer->stats, zrl, 1);
+        }
+    }
+}
+
+static void jpeg_encode_emit_bits(jpeg_encode_scan_t* scan, int value, int n) {
+    if (!scan->gather && n > 0) {
+        const uint16_t bits[2] = { (uint16_t)(value & ((1 << n) - 1)),
+                                   (uint16_t)n };
+        jpeg_encode_write_bits(scan->writer, &scan->bitBuf, &scan->bitCnt, bits);
+    }
+}
+
+static void jpeg_encode_emit_corr(jpeg_encode_scan_t* scan,
+        const uint8_t* corr, unsigned int n) {
+    for (unsigned int i = 0; i < n; i++) {
+        jpeg_encode_emit_bits(scan, corr[i], 1);
+    }
+}
+
+static void jpeg_encode_emit_eobrun(jpeg_encode_scan_t* scan,
+        jpeg_encode_huff_t* huff) {
+    if (scan->EOBRUN > 0) {
+        int n = 0;
+        for (unsigned int run = scan->EOBRUN; run >>= 1; ) { n++; }
+        jpeg_encode_emit_symbol(scan, huff, n << 4);
+        jpeg_encode_emit_bits(scan, (int)scan->EOBRUN, n);
+        if (!scan->gather) { jpeg_encode_stat(scan->writer->stats, eob, 1); }
+        scan->EOBRUN = 0;
+        jpeg_encode_emit_corr(scan, scan->corr, scan->BE);
+        scan->BE = 0;
+    }
+}
+
+static void jpeg_encode_ac_first(jpeg_encode_scan_t* scan,
+        jpeg_encode_huff_t* huff, const int16_t* block, int Ss, int Se, int Al) {
+    int r = 0;
+    for (int k = Ss; k <= Se; k++) {
+        int v = block[k];
+        int a = (v < 0 ? -v : v) >> Al; // point transform
+        if (a == 0) { r++; continue; }
+        jpeg_encode_emit_eobrun(scan, huff);
+        while (r > 15) {
+            jpeg_encode_emit_symbol(scan, huff, 0xF0);
+            r -= 16;
+        }
+        uint16_t bits[2];
+        jpeg_encode_calc_bits(v < 0 ? -a : a, bits);
+        jpeg_encode_emit_symbol(scan, huff, (r << 4) + bits[1]);
+        jpeg_encode_emit_bits(scan, bits[0], bits[1]);
+        r = 0;
+    }
+    if (r > 0) {
+        scan->EOBRUN++;
+        if (scan->EOBRUN == 0x7FFF) { jpeg_encode_emit_eobrun(scan, huff); }
+    }
+}
+
+static void jpeg_encode_ac_refine(jpeg_encode_scan_t* scan,
+        jpeg_encode_huff_t* huff, const int16_t* block, int Ss, int Se, int Al) {
+    int absolute[64];
+    int EOB = 0; // last coefficient that becomes nonzero in this scan
+    for (int k = Ss; k <= Se; k++) {
+        int v = block[k];
+        absolute[k] = (v < 0 ? -v : v) >> Al;
+        if (absolute[k] == 1) { EOB = k; }
+    }
+    int r = 0;
+    unsigned int BR = 0; // correction bits buffered for this block
+    uint8_t* corr = scan->corr + scan->BE;
+    for (int k = Ss; k <= Se; k++) {
+        int a = absolute[k];
+        if (a == 0) { r++; continue; }
+        while (r > 15 && k <= EOB) {
+            jpeg_encode_emit_eobrun(scan, huff);
+            jpeg_encode_emit_symbol(scan, huff, 0xF0);
+            r -= 16;
+            jpeg_encode_emit_corr(scan, corr, BR);
+            corr = scan->corr;
+            BR = 0;
+        }
+        if (a > 1) { // previously nonzero: just a correction bit
+            corr[BR++] = (uint8_t)(a & 1);
+            continue;
+        }
+        jpeg_encode_emit_eobrun(scan, huff);
+        jpeg_encode_emit_symbol(scan, huff, (r << 4) + 1);
+        jpeg_encode_emit_bits(scan, block[k] < 0 ? 0 : 1, 1);
+        jpeg_encode_emit_corr(scan, corr, BR);
+        corr = scan->corr;
+        BR = 0;
+        r = 0;
+    }
+    if (r > 0 || BR > 0) {
+        scan->EOBRUN++;
+        scan->BE += BR;
+        if (scan->EOBRUN == 0x7FFF ||
+            scan->BE > jpeg_encode_corr_bits - 64 + 1) {
+            jpeg_encode_emit_eobrun(scan, huff);
+        }
+    }
+}
+
+typedef struct jpeg_encode_frame_s {
+    int width;      // upright
+    int height;
+    int H;          // luma sampling factors, chroma is always 1x1
+    int V;
+    int mcus_x;
+    int mcus_y;
+} jpeg_encode_frame_t;
+
+static void jpeg_encode_frame(jpeg_encode_frame_t* frame, int width,
+        int height, int subsampling) {
+    frame->width = width;
+    frame->height = height;
+    frame->H = subsampling == 422 || subsampling == 420 ? 2 : 1;
+    frame->V = subsampling == 420 ? 2 : 1;
+    frame->mcus_x = (width + frame->H * 8 - 1) / (frame->H * 8);
+    frame->mcus_y = (height + frame->V * 8 - 1) / (frame->V * 8);
+}
+
+static void jpeg_encode_block(jpeg_encode_scan_t* scan,
+        const jpeg_encode_script_t* script, int c, const int16_t* block,
+        int DC[3], jpeg_encode_huff_t huff[2]) {
+    if (script->Ss == 0 && script->Ah == 0) {
+        jpeg_encode_huff_t* h = &huff[c == 0 ? 0 : 1];
+        int v = block[0] >> script->Al;
+        uint16_t bits[2];
+        jpeg_encode_calc_bits(v - DC[c], bits);
+        if (v == DC[c]) { bits[1] = 0; }
+        jpeg_encode_emit_symbol(scan, h, bits[1]);
+        jpeg_encode_emit_bits(scan, bits[0], bits[1]);
+        DC[c] = v;
+    } else if (script->Ss == 0) {
+        jpeg_encode_emit_bits(scan, block[0] >> script->Al, 1);
+    } else if (script->Ah == 0) {
+        jpeg_encode_ac_first(scan, &huff[0], block,
+                             script->Ss, script->Se, script->Al);
+    } else {
+        jpeg_encode_ac_refine(scan, &huff[0], block,
+                              script->Ss, script->Se, script->Al);
+    }
+}
+
+// coef[c] holds blocks of component c on the MCU padded grid
+static void jpeg_encode_scan(jpeg_encode_scan_t* scan,
+        const jpeg_encode_script_t* script, const jpeg_encode_frame_t* frame,
+        int16_t* coef[3], jpeg_encode_huff_t huff[2]) {
+    int DC[3] = {0};
+    scan->EOBRUN = 0;
+    scan->BE = 0;
+    if (script->comps > 1) { // interleaved: MCU order
+        for (int my = 0; my < frame->mcus_y; my++) {
+            for (int mx = 0; mx < frame->mcus_x; mx++) {
+                for (int i = 0; i < script->comps; i++) {
+                    const int c = script->comp[i];
+                    const int hc = c == 0 ? frame->H : 1;
+                    const int vc = c == 0 ? frame->V : 1;
+                    const int stride = frame->mcus_x * hc;
+                    for (int v = 0; v < vc; v++) {
+                        for (int h = 0; h < hc; h++) {
+                            size_t b = (size_t)(my * vc + v) * stride +
+                                       mx * hc + h;
+                            jpeg_encode_block(scan, script, c,
+                                coef[c] + b * 64, DC, huff);
+                        }
+                    }
+                }
+            }
+        }
+    } else { // non-interleaved: blocks of the component only
+        const int c = script->comp[0];
+        const int hc = c == 0 ? frame->H : 1;
+        const int vc = c == 0 ? frame->V : 1;
+        const int stride = frame->mcus_x * hc;
+        const int w = (frame->width * hc + frame->H - 1) / frame->H;
+        const int h = (frame->height * vc + frame->V - 1) / frame->V;
+        for (int by = 0; by < (h + 7) / 8; by++) {
+            for (int bx = 0; bx < (w + 7) / 8; bx++) {
+                size_t b = (size_t)by * stride + bx;
+                jpeg_encode_block(scan, script, c, coef[c] + b * 64, DC, huff);
+            }
+        }
+    }
+    jpeg_encode_emit_eobrun(scan, &huff[0]);
+}
+
+static void jpeg_encode_write_huff(jpeg_writer_t* writer, int id,
+        const jpeg_encode_huff_t* huff) {
+    jpeg_write_byte(writer, (uint8_t)id);
+    jpeg_write(writer, huff->bits + 1, 16);
+    jpeg_write(writer, huff->vals, huff->count);
+}
+
+// Preview: 8x8 block averages (DC of the unscaled float DCT is 64 times the
+// average) form a 1/8 scale image embedded as Exif APP1 IFD1 thumbnail.
+
+typedef struct jpeg_encode_preview_s {
+    int width;    // (image width + 7) / 8
+    int height;
+    uint8_t* rgb;
+} jpeg_encode_preview_t;
+
+// YDU, UDU, VDU hold the unscaled DCT left by jpeg_encode_quantize()
+static void jpeg_encode_preview_mcu(jpeg_encode_preview_t* preview,
+        const jpeg_encode_frame_t* frame, int mx, int my,
+        float YDU[4][64], const float UDU[64], const float VDU[64]) {
+    if (preview == NULL) { return; }
+    const float cb = UDU[0] / 64;
+    const float cr = VDU[0] / 64;
+    for (int i = 0; i < frame->H * frame->V; i++) {
+        const int x = mx * frame->H + i % frame->H;
+        const int y = my * frame->V + i / frame->H;
+        if (x < preview->width && y < preview->height) {
+            const float Y = YDU[i][0] / 64 + 128;
+            const float rgb[3] = { Y + 1.40200f * cr,
+                Y - 0.34414f * cb - 0.71414f * cr, Y + 1.77200f * cb };
+            uint8_t* p = preview->rgb + ((size_t)y * preview->width + x) * 3;
+            for (int k = 0; k < 3; k++) {
+                p[k] = (uint8_t)(rgb[k] < 0 ? 0 : rgb[k] > 255 ? 255 :
+                                 rgb[k] + 0.5f);
+            }
+        }
+    }
+}
+
+static uint8_t* jpeg_encode_le(uint8_t* p, uint32_t v, int bytes) {
+    for (int i = 0; i < bytes; i++) { *p++ = (uint8_t)(v >> (i * 8)); }
+    return p;
+}
+
+static uint8_t* jpeg_encode_ifd_entry(uint8_t* p, int tag, int type,
+        uint32_t value) {
+    p = jpeg_encode_le(p, tag, 2);
+    p = jpeg_encode_le(p, type, 2);
+    p = jpeg_encode_le(p, 1, 4);
+    return jpeg_encode_le(p, value, 4); // SHORT (3) left aligned
+}
+
+// APP1 "Exif\0\0", little endian TIFF header, IFD0 {Orientation} and
+// IFD1 {Compression, JPEGInterchangeFormat, JPEGInterchangeFormatLength}
+// followed by the thumbnail. Quality is halved until the segment fits.
+static int jpeg_encode_exif(const jpeg_encode_preview_t* preview,
+        int quality, jpeg_encode_memory_t* app1) {
+    enum { tiff = 4 + 6, thumbnail = 68, header = tiff + thumbnail };
+    quality = quality <= 0 ? 90 : quality;
+    for (;;) {
+        uint8_t h[header] = { 0xFF, 0xE1, 0, 0, 'E', 'x', 'i', 'f', 0, 0,
+                              'I', 'I', 0x2A, 0, 8, 0, 0, 0 };
+        app1->bytes = 0;
+        jpeg_encode_memory_write(app1, h, header);
+        if (jpeg_encode(app1, jpeg_encode_memory_write, preview->rgb,
+                preview->width, preview->height, 3, quality) != 0 ||
+            app1->error != 0) {
+            errno = app1->error != 0 ? app1->error : errno;
+            return -1;
+        }
+        const size_t bytes = app1->bytes - header;
+        if (app1->bytes - 2 <= 0xFFFF) {
+            uint8_t* p = h + 2;
+            *p++ = (uint8_t)((app1->bytes - 2) >> 8);
+            *p++ = (uint8_t)((app1->bytes - 2) & 0xFF);
+            p = h + tiff + 8;
+            p = jpeg_encode_le(p, 1, 2);
+            p = jpeg_encode_ifd_entry(p, 0x0112, 3, 1);
+            p = jpeg_encode_le(p, 8 + 18, 4);
+            p = jpeg_encode_le(p, 3, 2);
+            p = jpeg_encode_ifd_entry(p, 0x0103, 3, 6);
+            p = jpeg_encode_ifd_entry(p, 0x0201, 4, thumbnail);
+            p = jpeg_encode_ifd_entry(p, 0x0202, 4, (uint32_t)bytes);
+            jpeg_encode_le(p, 0, 4);
+            memcpy(app1->data, h, header);
+            return 0;
+        }
+        if (quality <= 5) { // does not fit: no thumbnail
+            app1->bytes = 0;
+            return 0;
+        }
+        quality /= 2;
+    }
+}
+
+// SOI, JFIF APP0, optional Exif APP1 preview and DQT
+static int jpeg_encode_head(jpeg_writer_t* writer,
+        const jpeg_encode_preview_t* preview, int quality,
+        const uint8_t YTable[64], const uint8_t UVTable[64]) {
+    static const uint8_t head0[] = { 0xFF,0xD8,0xFF,0xE0,0,0x10,
+        'J','F','I','F',0,1,1,0,0,1,0,1,0,0 };
+    static const uint8_t dqt[] = { 0xFF,0xDB,0,0x84,0 };
+    jpeg_write(writer, head0, sizeof(head0));
+    if (preview != NULL) {
+        jpeg_encode_memory_t app1 = {0};
+        const int r = jpeg_encode_exif(preview, quality, &app1);
+        if (r == 0) { jpeg_write(writer, app1.data, app1.bytes); }
+        free(app1.data);
+        if (r != 0) { return -1; }
+    }
+    jpeg_write(writer, dqt, sizeof(dqt));
+    jpeg_write(writer, YTable, 64);
+    jpeg_write_byte(writer, 1);
+    jpeg_write(writer, UVTable, 64);
+    return 0;
+}
+
+static int jpeg_encode_progressive(jpeg_writer_t* writer,
+        const jpeg_encode_source_t* source, const jpeg_encode_frame_t* frame,
+        jpeg_encode_preview_t* preview, int quality,
+        const uint8_t YTable[64], const uint8_t UVTable[64],
+        const float* fdtbl_Y, const float* fdtbl_UV, int dct) {
+    const int width = frame->width;
+    const int height = frame->height;
+    const int H = frame->H;
+    const int V = frame->V;
+    const size_t mcus = (size_t)frame->mcus_x * frame->mcus_y;
+    const size_t blocks = mcus * (H * V + 2);
+    int16_t* coef[3] = {0};
+    jpeg_encode_scan_t* scan = (jpeg_encode_scan_t*)malloc(sizeof(*scan));
+    jpeg_encode_huff_t* huff =
+        (jpeg_encode_huff_t*)malloc(2 * sizeof(jpeg_encode_huff_t));
+    coef[0] = (int16_t*)malloc(blocks * 64 * sizeof(int16_t));
+    if (scan == NULL || huff == NULL || coef[0] == NULL) {
+        free(coef[0]);
+        free(huff);
+        free(scan);
+        errno = ENOMEM;
+        return -1;
+    }
+    coef[1] = coef[0] + mcus * H * V * 64;
+    coef[2] = coef[1] + mcus * 64;
+    for (int my = 0; my < frame->mcus_y; my++) {
+        for (int mx = 0; mx < frame->mcus_x; mx++) {
+            float YDU[4][64], UDU[64], VDU[64];
+            int DU[64];
+            jpeg_encode_stat_start(t);
+            jpeg_encode_gather_mcu(source, mx * H * 8, my * V * 8, H, V,
+                                   YDU, UDU, VDU);
+            jpeg_encode_stat_since(writer->stats, gather, t);
+            for (int i = 0; i < H * V + 2; i++) {
+                const int c = i < H * V ? 0 : i - H * V + 1;
+                size_t b = c > 0 ? (size_t)my * frame->mcus_x + mx :
+                    (size_t)(my * V + i / H) * frame->mcus_x * H + mx * H + i % H;
+                float* CDU = c == 0 ? YDU[i] : c == 1 ? UDU : VDU;
+                jpeg_encode_quantize(CDU, c == 0 ? fdtbl_Y : fdtbl_UV, dct, DU,
+                                     writer->stats);
+                int16_t* block = coef[c] + b * 64;
+                int ac = 0;
+                for (int k = 0; k < 64; k++) {
+                    block[k] = (int16_t)DU[k];
+                    ac |= k > 0 ? DU[k] : 0;
+                }
+                jpeg_encode_stat(writer->stats, zero_ac, ac == 0);
+            }
+            jpeg_encode_preview_mcu(preview, frame, mx, my, YDU, UDU, VDU);
+        }
+    }
+    if (jpeg_encode_head(writer, preview, quality, YTable, UVTable) != 0) {
+        free(coef[0]);
+        free(huff);
+        free(scan);
+        return -1;
+    }
+    const uint8_t head1[] = { 0xFF,0xC2,0,0x11,8,
+        (uint8_t)(height >> 8), (uint8_t)(height & 0xFF),
+        (uint8_t)(width >> 8), (uint8_t)(width & 0xFF),
+        3, 1, (uint8_t)(H << 4 | V), 0, 2, 0x11, 1, 3, 0x11, 1 };
+    jpeg_write(writer, head1, sizeof(head1));
+    const int scripts = (int)(sizeof(jpeg_encode_script) /
+                              sizeof(jpeg_encode_script[0]));
+    for (int s = 0; s < scripts; s++) {
+        const jpeg_encode_script_t* script = &jpeg_encode_script[s];
+        const int dc = script->Ss == 0;
+        const int tables = !dc ? 1 : script->Ah == 0 ? 2 : 0;
+        memset(scan, 0, sizeof(*scan));
+        scan->writer = writer;
+        if (tables > 0) {
+            memset(huff, 0, 2 * sizeof(jpeg_encode_huff_t));
+            scan->gather = 1;
+            jpeg_encode_stat_start(t);
+            jpeg_encode_scan(scan, script, frame, coef, huff);
+            jpeg_encode_stat_since(writer->stats, entropy, t);
+            scan->gather = 0;
+            int length = 2;
+            for (int i = 0; i < tables; i++) {
+                jpeg_encode_optimize(&huff[i]);
+                length += 17 + huff[i].count;
+            }
+            const uint8_t dht[] = { 0xFF, 0xC4,
+                (uint8_t)(length >> 8), (uint8_t)(length & 0xFF) };
+            jpeg_write(writer, dht, sizeof(dht));
+            for (int i = 0; i < tables; i++) {
+                jpeg_encode_write_huff(writer, (dc ? 0x00 : 0x10) | i, &huff[i]);
+            }
+        }
+        const int length = 6 + 2 * script->comps;
+        uint8_t sos[4 + 1 + 6 + 3];
+        int n = 0;
+        sos[n++] = 0xFF;
+        sos[n++] = 0xDA;
+        sos[n++] = 0;
+        sos[n++] = (uint8_t)length;
+        sos[n++] = script->comps;
+        for (int i = 0; i < script->comps; i++) {
+            const int c = script->comp[i];
+            sos[n++] = (uint8_t)(c + 1);
+            sos[n++] = (uint8_t)(dc && c > 0 ? 0x10 : 0x00);
+        }
+        sos[n++] = script->Ss;
+        sos[n++] = script->Se;
+        sos[n++] = (uint8_t)(script->Ah << 4 | script->Al);
+        jpeg_write(writer, sos, n);
+        jpeg_encode_stat_start(t);
+        jpeg_encode_scan(scan, script, frame, coef, huff);
+        static const uint16_t fillBits[] = {0x7F, 7};
+        jpeg_encode_write_bits(writer, &scan->bitBuf, &scan->bitCnt, fillBits);
+        jpeg_encode_stat_since(writer->stats, entropy, t);
+    }
+    jpeg_write_byte(writer, 0xFF);
+    jpeg_write_byte(writer, 0xD9);
+    jpeg_writer_flush(writer);
+    free(coef[0]);
+    free(huff);
+    free(scan);
+    return 0;
+}
+
+// SOF0, standard DHT tables, DRI and SOS
+static void jpeg_encode_baseline_head(jpeg_writer_t* writer,
+        const jpeg_encode_frame_t* frame, int restart) {
+    const int width = frame->width;
+    const int height = frame->height;
+    const uint8_t head1[] = { 0xFF,0xC0,0,0x11,8,
+        (uint8_t)(height >> 8), (uint8_t)(height & 0xFF),
+        (uint8_t)(width >> 8), (uint8_t)(width & 0xFF),
+        3, 1, (uint8_t)(frame->H << 4 | frame->V), 0, 2, 0x11, 1, 3, 0x11, 1,
+        0xFF, 0xC4, 0x01, 0xA2,0 };
+    jpeg_write(writer, head1, sizeof(head1));
+    jpeg_write(writer, std_dc_luminance_nrcodes+1, sizeof(std_dc_luminance_nrcodes) - 1);
+    jpeg_write(writer, std_dc_luminance_values, sizeof(std_dc_luminance_values));
+    jpeg_write_byte(writer, 0x10); // HTYACinfo
+    jpeg_write(writer, std_ac_luminance_nrcodes+1, sizeof(std_ac_luminance_nrcodes) - 1);
+    jpeg_write(writer, std_ac_luminance_values, sizeof(std_ac_luminance_values));
+    jpeg_write_byte(writer, 1); // HTUDCinfo
+    jpeg_write(writer, std_dc_chrominance_nrcodes+1, sizeof(std_dc_chrominance_nrcodes) - 1);
+    jpeg_write(writer, std_dc_chrominance_values, sizeof(std_dc_chrominance_values));
+    jpeg_write_byte(writer, 0x11); // HTUACinfo
+    jpeg_write(writer, std_ac_chrominance_nrcodes+1, sizeof(std_ac_chrominance_nrcodes) - 1);
+    jpeg_write(writer, std_ac_chrominance_values, sizeof(std_ac_chrominance_values));
+    if (restart > 0) {
+        const uint8_t dri[] = { 0xFF, 0xDD, 0, 4,
+            (uint8_t)(restart >> 8), (uint8_t)(restart & 0xFF) };
+        jpeg_write(writer, dri, sizeof(dri));
+    }
+    static const uint8_t head2[] =
+        { 0xFF,0xDA,0,0xC,3,1,0,2,0x11,3,0x11,0,0x3F,0 };
+    jpeg_write(writer, head2, sizeof(head2));
+}
+
 int jpeg_encode(void* that, jpeg_write_t write, const void *data,
     int width, int height, int comp, int quality) {
-    static const uint8_t std_dc_luminance_nrcodes[] = {0,0,1,5,1,1,1,1,1,1,0,0,0,0,0,0,0};
-    static const uint8_t std_dc_luminance_values[] = {0,1,2,3,4,5,6,7,8,9,10,11};
-    static const uint8_t std_ac_luminance_nrcodes[] = {0,0,2,1,3,3,2,4,3,5,5,4,4,0,0,1,0x7d};
-    static const uint8_t std_ac_luminance_values[] = {
-        0x01,0x02,0x03,0x00,0x04,0x11,0x05,0x12,0x21,0x31,0x41,0x06,
-        0x13,0x51,0x61,0x07,0x22,0x71,0x14,0x32,0x81,0x91,0xa1,0x08,
-        0x23,0x42,0xb1,0xc1,0x15,0x52,0xd1,0xf0,0x24,0x33,0x62,0x72,
-        0x82,0x09,0x0a,0x16,0x17,0x18,0x19,0x1a,0x25,0x26,0x27,0x28,
-        0x29,0x2a,0x34,0x35,0x36,0x37,0x38,0x39,0x3a,0x43,0x44,0x45,
-        0x46,0x47,0x48,0x49,0x4a,0x53,0x54,0x55,0x56,0x57,0x58,0x59,
-        0x5a,0x63,0x64,0x65,0x66,0x67,0x68,0x69,0x6a,0x73,0x74,0x75,
-        0x76,0x77,0x78,0x79,0x7a,0x83,0x84,0x85,0x86,0x87,0x88,0x89,
-        0x8a,0x92,0x93,0x94,0x95,0x96,0x97,0x98,0x99,0x9a,0xa2,0xa3,
-        0xa4,0xa5,0xa6,0xa7,0xa8,0xa9,0xaa,0xb2,0xb3,0xb4,0xb5,0xb6,
-        0xb7,0xb8,0xb9,0xba,0xc2,0xc3,0xc4,0xc5,0xc6,0xc7,0xc8,0xc9,
-        0xca,0xd2,0xd3,0xd4,0xd5,0xd6,0xd7,0xd8,0xd9,0xda,0xe1,0xe2,
-        0xe3,0xe4,0xe5,0xe6,0xe7,0xe8,0xe9,0xea,0xf1,0xf2,0xf3,0xf4,
-        0xf5,0xf6,0xf7,0xf8,0xf9,0xfa
-    };
-    static const uint8_t std_dc_chrominance_nrcodes[] =
-        {0,0,3,1,1,1,1,1,1,1,1,1,0,0,0,0,0};
-    static const uint8_t std_dc_chrominance_values[] =
-        {0,1,2,3,4,5,6,7,8,9,10,11};
-    static const uint8_t std_ac_chrominance_nrcodes[] =
-        {0,0,2,1,2,4,4,3,4,7,5,4,4,0,1,2,0x77};
-    static const uint8_t std_ac_chrominance_values[] = {
-        0x00,0x01,0x02,0x03,0x11,0x04,0x05,0x21,0x31,0x06,0x12,0x41,
-        0x51,0x07,0x61,0x71,0x13,0x22,0x32,0x81,0x08,0x14,0x42,0x91,
-        0xa1,0xb1,0xc1,0x09,0x23,0x33,0x52,0xf0,0x15,0x62,0x72,0xd1,
-        0x0a,0x16,0x24,0x34,0xe1,0x25,0xf1,0x17,0x18,0x19,0x1a,0x26,
-        0x27,0x28,0x29,0x2a,0x35,0x36,0x37,0x38,0x39,0x3a,0x43,0x44,
-        0x45,0x46,0x47,0x48,0x49,0x4a,0x53,0x54,0x55,0x56,0x57,0x58,
-        0x59,0x5a,0x63,0x64,0x65,0x66,0x67,0x68,0x69,0x6a,0x73,0x74,
-        0x75,0x76,0x77,0x78,0x79,0x7a,0x82,0x83,0x84,0x85,0x86,0x87,
-        0x88,0x89,0x8a,0x92,0x93,0x94,0x95,0x96,0x97,0x98,0x99,0x9a,
-        0xa2,0xa3,0xa4,0xa5,0xa6,0xa7,0xa8,0xa9,0xaa,0xb2,0xb3,0xb4,
-        0xb5,0xb6,0xb7,0xb8,0xb9,0xba,0xc2,0xc3,0xc4,0xc5,0xc6,0xc7,
-        0xc8,0xc9,0xca,0xd2,0xd3,0xd4,0xd5,0xd6,0xd7,0xd8,0xd9,0xda,
-        0xe2,0xe3,0xe4,0xe5,0xe6,0xe7,0xe8,0xe9,0xea,0xf2,0xf3,0xf4,
-        0xf5,0xf6,0xf7,0xf8,0xf9,0xfa
-    };
-    // Huffman tables
-    static const uint16_t YDC_HT[256][2] =
-        { {0,2},{2,3},{3,3},{4,3},{5,3},{6,3},{14,4},
-          {30,5},{62,6},{126,7},{254,8},{510,9}};
-    static const uint16_t UVDC_HT[256][2] =
-        { {0,2},{1,2},{2,2},{6,3},{14,4},{30,5},{62,6},
-          {126,7},{254,8},{510,9},{1022,10},{2046,11}};
-    static const uint16_t YAC_HT[256][2] = {
-        {10,4},{0,2},{1,2},{4,3},{11,4},{26,5},{120,7},{248,8},{1014,10},
-        {65410,16},{65411,16},
-        {0,0},{0,0},{0,0},{0,0},{0,0},{0,0},{12,4},{27,5},{121,7},{502,9},
-        {2038,11},{65412,16},{65413,16}, {65414,16},{65415,16},{65416,16},
-        {0,0},{0,0},{0,0},{0,0},{0,0},{0,0},{28,5},{249,8},{1015,10},
-        {4084,12},{65417,16},{65418,16},{65419,16},{65420,16},{65421,16},
-        {65422,16},
-        {0,0},{0,0},{0,0},{0,0},{0,0},{0,0},{58,6},{503,9},{4085,12},
-        {65423,16},{65424,16},{65425,16},{65426,16},
-        {65427,16},{65428,16},{65429,16},
-        {0,0},{0,0},{0,0},{0,0},{0,0},{0,0},{59,6},{1016,10},{65430,16},
-        {65431,16},{65432,16},{65433,16},{65434,16},{65435,16},{65436,16},
-        {65437,16},
-        {0,0},{0,0},{0,0},{0,0},{0,0},{0,0},{122,7},{2039,11},{65438,16},
-        {65439,16},{65440,16},{65441,16},{65442,16},{65443,16},{65444,16},
-        {65445,16},
-        {0,0},{0,0},{0,0},{0,0},{0,0},{0,0},{123,7},{4086,12},{65446,16},
-        {65447,16},{65448,16},{65449,16},{65450,16},{65451,16},{65452,16},
-        {65453,16},
-        {0,0},{0,0},{0,0},{0,0},{0,0},{0,0},{250,8},{4087,12},{65454,16},
-        {65455,16},{65456,16},{65457,16},{65458,16},{65459,16},{65460,16},
-        {65461,16},
-        {0,0},{0,0},{0,0},{0,0},{0,0},{0,0},{504,9},{32704,15},{65462,16},
-        {65463,16},{65464,16},{65465,16},{65466,16},{65467,16},{65468,16},
-        {65469,16},
-        {0,0},{0,0},{0,0},{0,0},{0,0},{0,0},{505,9},{65470,16},{65471,16},
-        {65472,16},{65473,16},{65474,16},{65475,16},{65476,16},{65477,16},
-        {65478,16},
-        {0,0},{0,0},{0,0},{0,0},{0,0},{0,0},{506,9},{65479,16},{65480,16},
-        {65481,16},{65482,16},{65483,16},{65484,16},{65485,16},{65486,16},
-        {65487,16},
-        {0,0},{0,0},{0,0},{0,0},{0,0},{0,0},{1017,10},{65488,16},{65489,16},
-        {65490,16},{65491,16},{65492,16},{65493,16},{65494,16},{65495,16},
-        {65496,16},
-        {0,0},{0,0},{0,0},{0,0},{0,0},{0,0},{1018,10},{65497,16},{65498,16},
-        {65499,16},{65500,16},{65501,16},{65502,16},{65503,16},{65504,16},
-        {65505,16},
-        {0,0},{0,0},{0,0},{0,0},{0,0},{0,0},{2040,11},{65506,16},{65507,16},
-        {65508,16},{65509,16},{65510,16},{65511,16},{65512,16},{65513,16},
-        {65514,16},
-        {0,0},{0,0},{0,0},{0,0},{0,0},{0,0},{65515,16},{65516,16},{65517,16},
-        {65518,16},{65519,16},{65520,16},{65521,16},{65522,16},{65523,16},
-        {65524,16},
-        {0,0},{0,0},{0,0},{0,0},{0,0},
-        {2041,11},{65525,16},{65526,16},{65527,16},{65528,16},{65529,16},
-        {65530,16},{65531,16},{65532,16},{65533,16},{65534,16},
-        {0,0},{0,0},{0,0},{0,0},{0,0}
-    };
-    static const uint16_t UVAC_HT[256][2] = {
-        {0,2},{1,2},{4,3},{10,4},{24,5},{25,5},{56,6},{120,7},{500,9},{1014,10},{4084,12},
-        {0,0},{0,0},{0,0},{0,0},{0,0},{0,0},
-        {11,4},{57,6},{246,8},{501,9},{2038,11},{4085,12},{65416,16},{65417,16},{65418,16},{65419,16},
-        {0,0},{0,0},{0,0},{0,0},{0,0},{0,0},
-        {26,5},{247,8},{1015,10},{4086,12},{32706,15},{65420,16},{65421,16},{65422,16},{65423,16},{65424,16},{0,0},
-        {0,0},{0,0},{0,0},{0,0},{0,0},
-        {27,5},{248,8},{1016,10},{4087,12},{65425,16},{65426,16},{65427,16},{65428,16},{65429,16},{65430,16},
-        {0,0},{0,0},{0,0},{0,0},{0,0},{0,0},
-        {58,6},{502,9},{65431,16},{65432,16},{65433,16},{65434,16},{65435,16},{65436,16},{65437,16},{65438,16},
-        {0,0},{0,0},{0,0},{0,0},{0,0},{0,0},
-        {59,6},{1017,10},{65439,16},{65440,16},{65441,16},{65442,16},{65443,16},{65444,16},{65445,16},{65446,16},
-        {0,0},{0,0},{0,0},{0,0},{0,0},{0,0},
-        {121,7},{2039,11},{65447,16},{65448,16},{65449,16},{65450,16},{65451,16},{65452,16},{65453,16},{65454,16},
-        {0,0},{0,0},{0,0},{0,0},{0,0},{0,0},
-        {122,7},{2040,11},{65455,16},{65456,16},{65457,16},{65458,16},{65459,16},{65460,16},{65461,16},{65462,16},
-        {0,0},{0,0},{0,0},{0,0},{0,0},{0,0},
-        {249,8},{65463,16},{65464,16},{65465,16},{65466,16},{65467,16},{65468,16},{65469,16},{65470,16},{65471,16},
-        {0,0},{0,0},{0,0},{0,0},{0,0},{0,0},
-        {503,9},{65472,16},{65473,16},{65474,16},{65475,16},{65476,16},{65477,16},{65478,16},{65479,16},{65480,16},
-        {0,0},{0,0},{0,0},{0,0},{0,0},{0,0},
-        {504,9},{65481,16},{65482,16},{65483,16},{65484,16},{65485,16},{65486,16},{65487,16},{65488,16},{65489,16},
-        {0,0},{0,0},{0,0},{0,0},{0,0},{0,0},
-        {505,9},{65490,16},{65491,16},{65492,16},{65493,16},{65494,16},{65495,16},{65496,16},{65497,16},{65498,16},
-        {0,0},{0,0},{0,0},{0,0},{0,0},{0,0},
-        {506,9},{65499,16},{65500,16},{65501,16},{65502,16},{65503,16},{65504,16},{65505,16},{65506,16},{65507,16},
-        {0,0},{0,0},{0,0},{0,0},{0,0},{0,0},
-        {2041,11},{65508,16},{65509,16},{65510,16},{65511,16},{65512,16},{65513,16},{65514,16},{65515,16},{65516,16},
-        {0,0},{0,0},{0,0},{0,0},{0,0},{0,0},
-        {16352,14},{65517,16},{65518,16},{65519,16},{65520,16},{65521,16},{65522,16},{65523,16},{65524,16},{65525,16},
-        {0,0},{0,0},{0,0},{0,0},{0,0},
-        {1018,10},{32707,15},{65526,16},{65527,16},{65528,16},{65529,16},{65530,16},{65531,16},{65532,16},{65533,16},{65534,16},
-        {0,0},{0,0},{0,0},{0,0},{0,0}
-    };
-    static const int YQT[] = {
-        16,11,10,16,24,40,51,61,12,12,14,19,26,58,60,55,14,13,16,24,40,57,69,56,
-        14,17,22,29,51,87,80,62,18,22,37,56,68,109,103,77,24,35,55,64,81,104,113,
-        92,49,64,78,87,103,121,120,101,72,92,95,98,112,100,103,99};
-    static const int UVQT[] = {17,18,24,47,99,99,99,99,18,21,26,66,99,99,99,99,
-        24,26,56,99,99,99,99,99,47,66,99,99,99,99,99,99,99,99,99,99,99,99,99,99,
-        99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99};
-    static const float aasf[] = {
-        1.0f * 2.828427125f, 1.387039845f * 2.828427125f, 1.306562965f * 2.828427125f,
-        1.175875602f * 2.828427125f, 1.0f * 2.828427125f, 0.785694958f * 2.828427125f,
-        0.541196100f * 2.828427125f, 0.275899379f * 2.828427125f };
+    jpeg_encode_options_t options = { .quality = quality };
+    return jpeg_encode_ex(that, write, data, width, height, comp, &options);
+}
+
+int jpeg_encode_ex(void* that, jpeg_write_t write, const void *data,
+    int width, int height, int comp, const jpeg_encode_options_t* options) {
     jpeg_writer_t writer = {
         .that = that,
         .write = write,
         .bytes = 0
     };
-    if (data == NULL || width <= 0 || height <= 0 ||
-        comp < 1 || comp > 4 || comp == 2) {
+    const int subsampling = options == NULL ? 0 : options->subsampling;
+    if (data == NULL || options == NULL || width <= 0 || height <= 0 ||
+        comp < 1 || comp > 4 || comp == 2 ||
+        options->orientation < 0 || options->orientation > 8 ||
+        (subsampling != 0 && subsampling != 444 &&
+         subsampling != 422 && subsampling != 420) ||
+        options->restart < 0 || options->restart > 0xFFFF ||
+        options->dct < jpeg_dct_default || options->dct > jpeg_dct_float ||
+        (options->progressive && (options->restart > 0 || options->raw))) {
         errno = EINVAL;
         return -1;
     }
-    quality = quality <= 0 ? 90 : quality;
-    quality = quality < 1 ? 1 : quality > 100 ? 100 : quality;
-    quality = quality < 50 ? 5000 / quality : 200 - quality * 2;
+    if (options->stats != NULL) {
+        memset(options->stats, 0, sizeof(*options->stats));
+    }
+    writer.stats = options->stats;
+    jpeg_encode_source_t source;
+    jpeg_encode_source(&source, data, width, height, comp,
+                       options->orientation);
+    width = source.width;
+    height = source.height;
+    jpeg_encode_frame_t frame;
+    jpeg_encode_frame(&frame, width, height, subsampling);
+    const int H = frame.H;
+    const int V = frame.V;
     uint8_t YTable[64] = {0};
     uint8_t UVTable[64] = {0};
-    for (int i = 0; i < 64; i++) {
-        int yti = (YQT[i] * quality + 50) / 100;
-        YTable[zigzag[i]] = (uint8_t)(yti < 1 ? 1 : yti > 255 ? 255 : yti);
-        int uvti  = (UVQT[i] * quality + 50) / 100;
-        UVTable[zigzag[i]] = (uint8_t)(uvti < 1 ? 1 : uvti > 255 ? 255 : uvti);
-    }
     float fdtbl_Y[64] = {0};
     float fdtbl_UV[64] = {0};
-    for (int row = 0, k = 0; row < 8; row++) {
-        for (int col = 0; col < 8; col++) {
-            fdtbl_Y[k]  = 1 / (YTable [zigzag[k]] * aasf[row] * aasf[col]);
-            fdtbl_UV[k] = 1 / (UVTable[zigzag[k]] * aasf[row] * aasf[col]);
-            k++;
+    const int dct = options->dct;
+    jpeg_encode_tables(options->quality, dct, YTable, UVTable, fdtbl_Y, fdtbl_UV);
+    jpeg_encode_preview_t preview = {0};
+    jpeg_encode_preview_t* thumbnail = NULL;
+    if (options->preview && !options->raw) {
+        preview.width = (width + 7) / 8;
+        preview.height = (height + 7) / 8;
+        preview.rgb = (uint8_t*)malloc((size_t)preview.width * preview.height * 3);
+        if (preview.rgb == NULL) {
+            errno = ENOMEM;
+            return -1;
         }
+        thumbnail = &preview;
+    }
+    if (options->progressive) {
+        const int r = jpeg_encode_progressive(&writer, &source, &frame,
+            thumbnail, options->quality, YTable, UVTable, fdtbl_Y, fdtbl_UV,
+            dct);
+        free(preview.rgb);
+        return r;
+    }
+    // With preview entropy coded data is buffered in memory until the
+    // thumbnail made of its block averages can be written ahead of it.
+    jpeg_encode_memory_t memory = {0};
+    jpeg_writer_t buffered = {
+        .that = &memory,
+        .write = jpeg_encode_memory_write,
+        .stats = options->stats,
+        .bytes = 0
+    };
+    jpeg_writer_t* out = thumbnail != NULL ? &buffered : &writer;
+    const jpeg_mark_t mark = thumbnail != NULL ? NULL : options->mark;
+    if (!options->raw && thumbnail == NULL) {
+        jpeg_encode_head(&writer, NULL, options->quality, YTable, UVTable);
+        jpeg_encode_baseline_head(&writer, &frame, options->restart);
     }
-    // Write Headers
-    static const uint8_t head0[] = { 0xFF,0xD8,0xFF,0xE0,0,0x10,
-        'J','F','I','F',0,1,1,0,0,1,0,1,0,0,0xFF,0xDB,0,0x84,0 };
-    jpeg_write(&writer, head0, sizeof(head0));
-    jpeg_write(&writer, YTable, sizeof(YTable));
-    jpeg_write_byte(&writer, 1);
-    jpeg_write(&writer, UVTable, sizeof(UVTable));
-    const uint8_t head1[] = { 0xFF,0xC0,0,0x11,8,
-        (uint8_t)(height >> 8), (uint8_t)(height & 0xFF),
-        (uint8_t)(width >> 8), (uint8_t)(width & 0xFF),
-        3, 1, 0x11, 0, 2, 0x11, 1, 3, 0x11, 1, 0xFF, 0xC4, 0x01, 0xA2,0 };
-    jpeg_write(&writer, head1, sizeof(head1));
-    jpeg_write(&writer, std_dc_luminance_nrcodes+1, sizeof(std_dc_luminance_nrcodes) - 1);
-    jpeg_write(&writer, std_dc_luminance_values, sizeof(std_dc_luminance_values));
-    jpeg_write_byte(&writer, 0x10); // HTYACinfo
-    jpeg_write(&writer, std_ac_luminance_nrcodes+1, sizeof(std_ac_luminance_nrcodes) - 1);
-    jpeg_write(&writer, std_ac_luminance_values, sizeof(std_ac_luminance_values));
-    jpeg_write_byte(&writer, 1); // HTUDCinfo
-    jpeg_write(&writer, std_dc_chrominance_nrcodes+1, sizeof(std_dc_chrominance_nrcodes) - 1);
-    jpeg_write(&writer, std_dc_chrominance_values, sizeof(std_dc_chrominance_values));
-    jpeg_write_byte(&writer, 0x11); // HTUACinfo
-    jpeg_write(&writer, std_ac_chrominance_nrcodes+1, sizeof(std_ac_chrominance_nrcodes) - 1);
-    jpeg_write(&writer, std_ac_chrominance_values, sizeof(std_ac_chrominance_values));
-    static const uint8_t head2[] =
-        { 0xFF,0xDA,0,0xC,3,1,0,2,0x11,3,0x11,0,0x3F,0 };
-    jpeg_write(&writer, head2, sizeof(head2));
     // Encode 8x8 macroblocks
-    const uint8_t* imageData = (const uint8_t*)data;
     int DCY = 0;
     int DCU = 0;
     int DCV = 0;
     int32_t bitBuf=0;
     int32_t bitCnt=0;
-    int ofsG = comp > 1 ? 1 : 0, ofsB = comp > 1 ? 2 : 0;
-    for (int y = 0; y < height; y += 8) {
-        for (int x = 0; x < width; x += 8) {
-            float YDU[64] = {0};
+    static const uint16_t fillBits[] = {0x7F, 7};
+    int mcu = 0;
+    for (int y = 0; y < height; y += V * 8) {
+        for (int x = 0; x < width; x += H * 8) {
+            if (options->restart > 0 && mcu > 0 && mcu % options->restart == 0) {
+                const int interval = mcu / options->restart - 1;
+                jpeg_encode_write_bits(out, &bitBuf, &bitCnt, fillBits);
+                bitBuf = 0;
+                bitCnt = 0;
+                jpeg_write_byte(out, 0xFF);
+                jpeg_write_byte(out, (uint8_t)(0xD0 + interval % 8));
+                if (mark != NULL) {
+                    jpeg_writer_flush(out);
+                    mark(that, jpeg_mark_restart, interval);
+                }
+                DCY = 0;
+                DCU = 0;
+                DCV = 0;
+            }
+            float YDU[4][64] = {0};
             float UDU[64] = {0};
             float VDU[64] = {0};
-            for (int row = y, pos = 0; row < y + 8; row++) {
-                for (int col = x; col < x + 8; col++) {
-                    int p = row*width*comp + col*comp;
-                    if (row >= height) {
-                        p -= width * comp * (row + 1 - height);
-                    }
-                    if (col >= width) {
-                        p -= comp * (col + 1 - width);
-                    }
-                    float r = imageData[p+0];
-                    float g = imageData[p+ofsG];
-                    float b = imageData[p+ofsB];
-                    YDU[pos] = +0.29900f*r + 0.58700f * g + 0.11400f * b - 128;
-                    UDU[pos] = -0.16874f*r - 0.33126f * g + 0.50000f * b;
-                    VDU[pos] = +0.50000f*r - 0.41869f * g - 0.08131f * b;
-                    pos++;
-                }
+            jpeg_encode_stat_start(t);
+            jpeg_encode_gather_mcu(&source, x, y, H, V, YDU, UDU, VDU);
+            jpeg_encode_stat_since(out->stats, gather, t);
+            for (int i = 0; i < H * V; i++) {
+                DCY = jpeg_encode_process(out, &bitBuf, &bitCnt, YDU[i], fdtbl_Y, dct, DCY, YDC_HT, YAC_HT);
             }
-            DCY = jpeg_encode_process(&writer, &bitBuf, &bitCnt, YDU, fdtbl_Y, DCY, YDC_HT, YAC_HT);
-            DCU = jpeg_encode_process(&writer, &bitBuf, &bitCnt, UDU, fdtbl_UV, DCU, UVDC_HT, UVAC_HT);
-            DCV = jpeg_encode_process(&writer, &bitBuf, &bitCnt, VDU, fdtbl_UV, DCV, UVDC_HT, UVAC_HT);
+            DCU = jpeg_encode_process(out, &bitBuf, &bitCnt, UDU, fdtbl_UV, dct, DCU, UVDC_HT, UVAC_HT);
+            DCV = jpeg_encode_process(out, &bitBuf, &bitCnt, VDU, fdtbl_UV, dct, DCV, UVDC_HT, UVAC_HT);
+            jpeg_encode_preview_mcu(thumbnail, &frame, x / (H * 8), y / (V * 8),
+                                    YDU, UDU, VDU);
+            mcu++;
+        }
+        if (mark != NULL) {
+            jpeg_writer_flush(out);
+            mark(that, jpeg_mark_row, y / (V * 8));
         }
     }
     // Do the bit alignment of the EOI marker
-    static const uint16_t fillBits[] = {0x7F, 7};
-    jpeg_encode_write_bits(&writer, &bitBuf, &bitCnt, fillBits);
+    jpeg_encode_write_bits(out, &bitBuf, &bitCnt, fillBits);
+    jpeg_writer_flush(out);
+    int r = 0;
+    if (thumbnail != NULL) {
+        r = memory.error != 0 ? -1 :
+            jpeg_encode_head(&writer, thumbnail, options->quality, YTable, UVTable);
+        if (r == 0) {
+            jpeg_encode_baseline_head(&writer, &frame, options->restart);
+            jpeg_write(&writer, memory.data, memory.bytes);
+        } else if (memory.error != 0) {
+            errno = memory.error;
+        }
+        free(memory.data);
+        free(preview.rgb);
+    }
     // EOI
-    jpeg_write_byte(&writer, 0xFF);
-    jpeg_write_byte(&writer, 0xD9);
+    if (!options->raw && r == 0) {
+        jpeg_write_byte(&writer, 0xFF);
+        jpeg_write_byte(&writer, 0xD9);
+    }
     jpeg_writer_flush(&writer);
+    return r;
+}
+
+// RTP/JPEG (RFC 2435)
+
+static int jpeg_rtp_header(const jpeg_rtp_t* rtp, int offset) {
+    return 8 + (rtp->dri > 0 ? 4 : 0) +
+           (rtp->q >= 128 && offset == 0 ? 4 + 128 : 0);
+}
+
+static void jpeg_rtp_send(jpeg_rtp_t* rtp, int bytes, int last) {
+    uint8_t* p = rtp->packet;
+    *p++ = 0; // type specific
+    *p++ = (uint8_t)(rtp->offset >> 16);
+    *p++ = (uint8_t)(rtp->offset >> 8);
+    *p++ = (uint8_t)(rtp->offset);
+    *p++ = (uint8_t)rtp->type;
+    *p++ = (uint8_t)rtp->q;
+    *p++ = (uint8_t)rtp->width;
+    *p++ = (uint8_t)rtp->height;
+    if (rtp->dri > 0) {
+        const int L = bytes == rtp->start || last; // ends at interval end
+        const int count = (rtp->first << 15) | (L << 14) |
+                          (rtp->count & 0x3FFF);
+        *p++ = (uint8_t)(rtp->dri >> 8);
+        *p++ = (uint8_t)(rtp->dri);
+        *p++ = (uint8_t)(count >> 8);
+        *p++ = (uint8_t)(count);
+    }
+    if (rtp->q >= 128 && rtp->offset == 0) {
+        *p++ = 0; // MBZ
+        *p++ = 0; // 8 bit precision
+        *p++ = 0;
+        *p++ = (uint8_t)sizeof(rtp->tables);
+        memcpy(p, rtp->tables, sizeof(rtp->tables));
+    }
+    rtp->send(rtp->that, rtp->packet, rtp->header + bytes, last);
+}
+
+// packet is full: send it up to the last restart interval boundary
+static void jpeg_rtp_next(jpeg_rtp_t* rtp) {
+    const int split = rtp->start > 0 ? rtp->start : rtp->bytes;
+    jpeg_rtp_send(rtp, split, 0);
+    const int rest = rtp->bytes - split;
+    const int header = rtp->header;
+    rtp->offset += split;
+    rtp->header = jpeg_rtp_header(rtp, rtp->offset);
+    memmove(rtp->packet + rtp->header, rtp->packet + header + split, rest);
+    rtp->bytes = rest;
+    rtp->first = rtp->start > 0;
+    rtp->start = rtp->start > 0 ? 0 : -1;
+    rtp->count = rtp->interval;
+}
+
+static void jpeg_rtp_write(void* that, const void *data, int bytes) {
+    jpeg_rtp_t* rtp = (jpeg_rtp_t*)that;
+    const uint8_t* d = (const uint8_t*)data;
+    while (bytes > 0) {
+        int room = rtp->mtu - rtp->header - rtp->bytes;
+        if (room == 0) {
+            jpeg_rtp_next(rtp);
+        } else {
+            int n = bytes < room ? bytes : room;
+            memcpy(rtp->packet + rtp->header + rtp->bytes, d, n);
+            rtp->bytes += n;
+            d += n;
+            bytes -= n;
+        }
+    }
+}
+
+static void jpeg_rtp_mark(void* that, int mark, int index) {
+    jpeg_rtp_t* rtp = (jpeg_rtp_t*)that;
+    if (mark == jpeg_mark_restart) {
+        rtp->interval = index + 1;
+        rtp->start = rtp->bytes;
+        if (rtp->start == 0) { // packet starts exactly at the boundary
+            rtp->first = 1;
+            rtp->count = rtp->interval;
+        }
+    }
+}
+
+int jpeg_encode_rtp(jpeg_rtp_t* rtp, const void *data, int width, int height,
+        int comp, const jpeg_encode_options_t* options) {
+    jpeg_encode_options_t o = options != NULL ?
+        *options : (jpeg_encode_options_t){ .quality = 0 };
+    o.subsampling = o.subsampling == 0 ? 420 : o.subsampling;
+    const int transposed = o.orientation >= 5;
+    const int w = transposed ? height : width;
+    const int h = transposed ? width : height;
+    if (rtp == NULL || rtp->send == NULL || o.progressive ||
+        (o.subsampling != 420 && o.subsampling != 422) ||
+        w <= 0 || h <= 0 || w > 2040 || h > 2040 ||
+        rtp->mtu < 0 || rtp->mtu > jpeg_rtp_max_mtu) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (rtp->mtu == 0) { rtp->mtu = 1400; }
+    const int quality = o.quality <= 0 ? 90 : o.quality;
+    rtp->type = (o.subsampling == 420 ? 1 : 0) + (o.restart > 0 ? 64 : 0);
+    rtp->q = quality < 100 ? quality : 255;
+    rtp->width = (w + 7) / 8;
+    rtp->height = (h + 7) / 8;
+    rtp->dri = o.restart;
+    rtp->offset = 0;
+    rtp->header = jpeg_rtp_header(rtp, 0);
+    rtp->bytes = 0;
+    rtp->start = 0;
+    rtp->first = 1;
+    rtp->count = 0;
+    rtp->interval = 0;
+    if (rtp->mtu < rtp->header + 1) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (rtp->q >= 128) {
+        float fdtbl_Y[64];
+        float fdtbl_UV[64];
+        jpeg_encode_tables(quality, 0, rtp->tables, rtp->tables + 64,
+                           fdtbl_Y, fdtbl_UV);
+    }
+    o.raw = 1;
+    o.mark = jpeg_rtp_mark;
+    int r = jpeg_encode_ex(rtp, jpeg_rtp_write, data, width, height, comp, &o);
+    if (r == 0) { jpeg_rtp_send(rtp, rtp->bytes, 1); }
+    return r;
+}
+
+enum { jpeg_encode_header_bytes = 609 }; // SOI..SOS + EOI of jpeg_encode()
+
+typedef struct jpeg_rate_counter_s {
+    void* that;
+    jpeg_write_t write;
+    int bytes;
+} jpeg_rate_counter_t;
+
+static void jpeg_rate_count(void* that, const void *data, int bytes) {
+    jpeg_rate_counter_t* counter = (jpeg_rate_counter_t*)that;
+    counter->write(counter->that, data, bytes);
+    counter->bytes += bytes;
+}
+
+void jpeg_rate_init(jpeg_rate_t* rate, int bitrate, int fps) {
+    memset(rate, 0, sizeof(*rate));
+    rate->bitrate = bitrate;
+    rate->fps = fps;
+}
+
+int jpeg_encode_rate(jpeg_rate_t* rate, void* that, jpeg_write_t write,
+        const void *data, int width, int height, int comp) {
+    if (rate == NULL || rate->bitrate <= 0 || rate->fps <= 0 ||
+        width <= 0 || height <= 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (rate->buffer <= 0) { rate->buffer = rate->bitrate / 2; }
+    if (rate->min_quality <= 0) { rate->min_quality = 5; }
+    if (rate->max_quality <= 0) { rate->max_quality = 95; }
+    if (rate->frames == 0) {
+        rate->fullness = rate->buffer / 2;
+        // ~1.5 bits per pixel for a typical photo at quality 50
+        rate->complexity = rate->complexity > 0 ? rate->complexity : 32;
+    }
+    const double blocks = (double)((width + 7) / 8) * ((height + 7) / 8) * 3;
+    const double per_frame = (double)rate->bitrate / rate->fps;
+    // steer virtual buffer towards half full in ~4 frames:
+    double target = per_frame + (rate->buffer / 2 - rate->fullness) / 4.0;
+    target = target < per_frame / 4 ? per_frame / 4 : target;
+    target = target > per_frame * 2 ? per_frame * 2 : target;
+    double payload = target - jpeg_encode_header_bytes * 8;
+    payload = payload < blocks ? blocks : payload;
+    // bits per block ~ complexity * 100 / scale
+    int quality = jpeg_encode_quality(rate->complexity * 100 * blocks / payload);
+    quality = quality < rate->min_quality ? rate->min_quality : quality;
+    quality = quality > rate->max_quality ? rate->max_quality : quality;
+    const int scale = jpeg_encode_scale(quality);
+    rate->predicted = (int)(rate->complexity * 100 * blocks / scale / 8) +
+                      jpeg_encode_header_bytes;
+    jpeg_rate_counter_t counter = { .that = that, .write = write, .bytes = 0 };
+    int r = jpeg_encode(&counter, jpeg_rate_count, data, width, height,
+                        comp, quality);
+    if (r != 0) { return r; }
+    rate->quality = quality;
+    rate->bytes = counter.bytes;
+    int payload_bytes = counter.bytes - jpeg_encode_header_bytes;
+    double sample = (payload_bytes > 0 ? payload_bytes * 8.0 : 1.0) *
+                    scale / (100 * blocks);
+    rate->complexity = rate->frames == 0 ?
+        sample : (rate->complexity + sample) / 2;
+    rate->fullness += (long long)counter.bytes * 8 - (long long)per_frame;
+    if (rate->fullness < 0) {
+        rate->fullness = 0;
+        rate->underflows++;
+    } else if (rate->fullness > rate->buffer) {
+        rate->fullness = rate->buffer;
+        rate->overflows++;
+    }
+    rate->frames++;
+    return 0;
+}
+
+// quantized DC coefficients of the block at (x, y) without full DCT
+static void jpeg_encode_dc(const jpeg_encode_source_t* source, int x, int y,
+        const float* fdtbl_Y, const float* fdtbl_UV, int DC[3]) {
+    float YDU[64], UDU[64], VDU[64];
+    jpeg_encode_gather(source, x, y, YDU, UDU, VDU);
+    float sum[3] = {0};
+    for (int i = 0; i < 64; i++) {
+        sum[0] += YDU[i];
+        sum[1] += UDU[i];
+        sum[2] += VDU[i];
+    }
+    for (int i = 0; i < 3; i++) {
+        float v = sum[i] * (i == 0 ? fdtbl_Y[0] : fdtbl_UV[0]);
+        DC[i] = (int)(v < 0 ? ceilf(v - 0.5f) : floorf(v + 0.5f));
+    }
+}
+
+int jpeg_encode_estimate(const void *data, int width, int height, int comp,
+        int quality, int step, jpeg_estimate_t* estimate) {
+    if (data == NULL || estimate == NULL || width <= 0 || height <= 0 ||
+        comp < 1 || comp > 4 || comp == 2 || step < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    step = step == 0 ? 8 : step;
+    uint8_t YTable[64];
+    uint8_t UVTable[64];
+    float fdtbl_Y[64];
+    float fdtbl_UV[64];
+    jpeg_encode_tables(quality, 0, YTable, UVTable, fdtbl_Y, fdtbl_UV);
+    jpeg_encode_source_t source;
+    jpeg_encode_source(&source, data, width, height, comp, 1);
+    const int mcus_x = (width + 7) / 8;
+    const int mcus_y = (height + 7) / 8;
+    double sum = 0; // bits
+    double sum2 = 0;
+    int n = 0;
+    // samples are counted as one stream so 0xFF bytes straddling MCUs
+    // are seen at the alignments the encoder produces them
+    jpeg_encode_counter_t counter = {0};
+    for (int by = 0; by < mcus_y; by++) {
+        // diagonal pattern samples every column and every row
+        for (int bx = (step - by % step) % step; bx < mcus_x; bx += step) {
+            int x = bx * 8;
+            int y = by * 8;
+            int DC[3] = {0};
+            if (bx > 0) {
+                jpeg_encode_dc(&source, x - 8, y, fdtbl_Y, fdtbl_UV, DC);
+            } else if (by > 0) {
+                jpeg_encode_dc(&source, (mcus_x - 1) * 8, y - 8,
+                               fdtbl_Y, fdtbl_UV, DC);
+            }
+            float YDU[64], UDU[64], VDU[64];
+            int DU[64];
+            jpeg_encode_gather(&source, x, y, YDU, UDU, VDU);
+            jpeg_encode_quantize(YDU, fdtbl_Y, 0, DU, NULL);
+            int64_t before = counter.bits;
+            jpeg_encode_count(&counter, DU, DC[0], YDC_HT, YAC_HT);
+            jpeg_encode_quantize(UDU, fdtbl_UV, 0, DU, NULL);
+            jpeg_encode_count(&counter, DU, DC[1], UVDC_HT, UVAC_HT);
+            jpeg_encode_quantize(VDU, fdtbl_UV, 0, DU, NULL);
+            jpeg_encode_count(&counter, DU, DC[2], UVDC_HT, UVAC_HT);
+            double bits = (double)(counter.bits - before);
+            sum += bits;
+            sum2 += bits * bits;
+            n++;
+        }
+    }
+    const double N = (double)mcus_x * mcus_y;
+    const double mean = sum / n;
+    // sample standard deviation (coefficient of variation 1 if unknown)
+    double sd = n > 1 ? sqrt((sum2 - sum * mean) / (n - 1)) : mean;
+    double error = 2 * N * sd / sqrt((double)n) * sqrt(1 - n / N); // bits
+    double bits = N * mean; // stuffed 0x00 bytes included
+    // model error: approximate DC predictors, stuffing across sample seams
+    error += bits / 1000;
+    estimate->bytes = jpeg_encode_header_bytes + 1 +
+                      (int)(bits / 8 + 0.5);
+    estimate->low = jpeg_encode_header_bytes + 1 +
+                    (int)((bits - error) / 8 + 0.5);
+    estimate->high = jpeg_encode_header_bytes + 1 +
+                     (int)((bits + error) / 8 + 0.5);
+    if (estimate->low < jpeg_encode_header_bytes) {
+        estimate->low = jpeg_encode_header_bytes;
+    }
+    estimate->samples = n;
     return 0;
 }
 